@@ -26,6 +26,7 @@
 #include "pod5.h"
 #include "fast5.h"
 #include "config.h"
+#include "profile.h"
 
 
 static const char *help=
@@ -39,9 +40,12 @@ static const char *help=
 "  -o,--output               path to output file that will be generated.\n"
 "Optional arguments are:\n"
 "  -t,--threads              number of threads (default is 1 thread),\n"
+"  --io-threads              number of threads for bam decompression (default is 2 threads),\n"
 "  -m,--maxReads             maximum number of reads to consider,\n"
 "  -q,--quality              minimum mapping quality (default is 20),\n"
-"  -l,--length               minimum read length in bp (default is 100).\n"
+"  -l,--length               minimum read length in bp (default is 100),\n"
+"  --exclude-flags           skip records with any of these bam flags set (default is 0x904: unmapped, secondary, and supplementary),\n"
+"  --shard                   run only shard i of N (given as i/N, 0 <= i < N) of the reads, assigned by readID so that split reads stay with their parent.\n"
 "DNAscent is under active development by the Boemo Group, Department of Pathology, University of Cambridge (https://www.boemogroup.org/).\n"
 "Please submit bug reports to GitHub Issues (https://github.com/MBoemo/DNAscent/issues).";
 
@@ -53,7 +57,10 @@ struct Arguments_alignment {
 	bool capReads;
 	int minQ, maxReads;
 	int minL;
+	uint16_t excludeFlags = defaultExcludeFlags;
 	unsigned int threads;
+	unsigned int ioThreads;
+	unsigned int shard, numShards;
 };
 
 Arguments_alignment parseAlignArguments_alignment( int argc, char** argv ){
@@ -79,6 +86,9 @@ Arguments_alignment parseAlignArguments_alignment( int argc, char** argv ){
 
 	/*defaults - we'll override these if the option was specified by the user */
 	args.threads = 1;
+	args.ioThreads = 2;
+	args.shard = 0;
+	args.numShards = 1;
 	args.minQ = 20;
 	args.minL = 100;
 	args.capReads = false;
@@ -114,6 +124,22 @@ Arguments_alignment parseAlignArguments_alignment( int argc, char** argv ){
 			args.threads = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--io-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.ioThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--shard" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			parseShard(strArg, args.shard, args.numShards);
+			i+=2;
+		}
 		else if ( flag == "-q" or flag == "--quality" ){
 
 			if (i == argc-1) throw TrailingFlag(flag);
@@ -130,6 +156,14 @@ Arguments_alignment parseAlignArguments_alignment( int argc, char** argv ){
 			args.minL = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--exclude-flags" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.excludeFlags = std::stoi( strArg.c_str(), nullptr, 0 );
+			i+=2;
+		}
 		else if ( flag == "-i" or flag == "--index" ){
 
 			if (i == argc-1) throw TrailingFlag(flag);
@@ -659,6 +693,7 @@ void eventalign( DNAscent::read &r, unsigned int totalWindowLength){
 		
 		std::pair< double, std::vector<std::string> > builtinAlignment;
 		try {
+			ProfileTimer timer(ProfileStage::Viterbi);
 			builtinAlignment = builtinViterbi( eventSnippet_means, readSnippet, r.scalings, false);
 		} catch (const std::exception& e) {
 			// Optional: Log or handle the exception here
@@ -716,8 +751,8 @@ void eventalign( DNAscent::read &r, unsigned int totalWindowLength){
 			if (label == "M"){
 				std::pair<double,double> meanStd = Pore_Substrate_Config.pore_model[kmer2index(kmerStrand, k)];
 
-				for (unsigned int idx_raw = 0; idx_raw < eventSnippet[evIdx].raw.size(); idx_raw++){
-					double scaledEvent = (eventSnippet[evIdx].raw[idx_raw] - r.scalings.shift) / r.scalings.scale;
+				for (unsigned int idx_raw = 0; idx_raw < eventSnippet[evIdx].rawLength; idx_raw++){
+					double scaledEvent = (r.raw_pA(eventSnippet[evIdx].rawStart + idx_raw) - r.scalings.shift) / r.scalings.scale;
 					if (r.refCoordToCalls.count(event_coord) > 0){
 						r.humanReadable_eventalignOut += std::to_string(event_coord) 
 							      + "\t" + kmerRef 
@@ -741,8 +776,8 @@ void eventalign( DNAscent::read &r, unsigned int totalWindowLength){
 
 			}
 			else if (label == "I" and evIdx < lastM_ev){ //don't print insertions after the last match because we're going to align these in the next segment
-				for (unsigned int idx_raw = 0; idx_raw < eventSnippet[evIdx].raw.size(); idx_raw++){
-					double scaledEvent = (eventSnippet[evIdx].raw[idx_raw] - r.scalings.shift) / r.scalings.scale;
+				for (unsigned int idx_raw = 0; idx_raw < eventSnippet[evIdx].rawLength; idx_raw++){
+					double scaledEvent = (r.raw_pA(eventSnippet[evIdx].rawStart + idx_raw) - r.scalings.shift) / r.scalings.scale;
 					r.humanReadable_eventalignOut += std::to_string(event_coord) + "\t" + kmerRef + "\t" + std::to_string(scaledEvent) + "\t" + std::string(k, 'N') + "\t" + "0" + "\n";
 				}
 			}
@@ -764,8 +799,8 @@ int align_main( int argc, char** argv ){
 	Arguments_alignment args = parseAlignArguments_alignment( argc, argv );
 
 	//load DNAscent index
-	std::map< std::string, IndexEntry > readID2path;
-	parseIndex( args.indexFilename, readID2path );
+	SignalIndex readIndex;
+	parseIndex( args.indexFilename, readIndex );
 
 	//import fasta reference
 	std::map< std::string, std::string > reference = import_reference_pfasta( args.referenceFilename );
@@ -773,24 +808,24 @@ int align_main( int argc, char** argv ){
 	std::ofstream outFile( args.outputFilename );
 	if ( not outFile.is_open() ) throw IOerror( args.outputFilename );
 
+	//decompresses the bam on its own threads
+	HtsIOPool ioPool(args.ioThreads);
+
 	//load the bam
 	std::cout << "Opening bam file... ";
-	htsFile *bam_fh_cr = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh_cr == NULL) throw IOerror(args.bamFilename);
+	htsFile *bam_fh = openAlignmentFile(args.bamFilename, "r", &ioPool, args.referenceFilename);
 
 	//load the header
-	bam_hdr_t *bam_hdr_cr = sam_hdr_read(bam_fh_cr);
+	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
 	std::cout << "ok." << std::endl;
 
-	/*initialise progress */
-	int numOfRecords = 0, prog = 0, failed = 0;
-	countRecords( bam_fh_cr, bam_hdr_cr, numOfRecords, args.minQ, args.minL );
-	if (args.capReads){
-		numOfRecords = std::min(numOfRecords,args.maxReads);
-	}
-	progressBar pb(numOfRecords,true);
-	bam_hdr_destroy(bam_hdr_cr);
-	hts_close(bam_fh_cr);
+	/*initialise progress - estimated from the bam as it's read so that the bam is only decoded once */
+	int prog = 0, failed = 0;
+	BamProgress bamProgress(bam_fh, bam_hdr, args.bamFilename);
+	progressBar pb(true);
+
+	//with a cap on the number of reads, we're done at whichever comes first
+	auto progressFraction = [&](){ return args.capReads ? std::max(bamProgress.fraction(), (double) prog / args.maxReads) : bamProgress.fraction(); };
 
 	pod5_init();
 
@@ -800,28 +835,19 @@ int align_main( int argc, char** argv ){
 	if ( args.threads <= 4 ) maxBufferSize = args.threads;
 	else maxBufferSize = 4*(args.threads);
 
-	htsFile *bam_fh = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh == NULL) throw IOerror(args.bamFilename);
-	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
+	ReadFilter readFilter(args.minQ, args.minL, args.excludeFlags);
+
 	bam1_t *itr_record = bam_init1();
 	int result = sam_read1(bam_fh, bam_hdr, itr_record);
 
 	while(result >= 0){
-	
-		bam1_t *record = bam_dup1(itr_record);
 
-		//add the record to the buffer if it passes the user's criteria, otherwise destroy it cleanly
-		int mappingQual = record -> core.qual;
-		int refStart,refEnd;
-		getRefEnd(record,refStart,refEnd);
-		int queryLen = record -> core.l_qseq;
-
-		if ( mappingQual >= args.minQ and refEnd - refStart >= args.minL and queryLen != 0 ){
+		bamProgress.update();
+	
+		//add the record to the buffer if it passes the user's criteria - records that don't are never copied
+		if ( readFilter.pass(itr_record) and inShard(itr_record, args.shard, args.numShards) ){
 
-			buffer.push_back(record);
-		}
-		else{
-			bam_destroy1(record);
+			buffer.push_back(bam_dup1(itr_record));
 		}
 
 		result = sam_read1(bam_fh, bam_hdr, itr_record);
@@ -829,19 +855,48 @@ int align_main( int argc, char** argv ){
 		//if we've filled up the buffer with reads, compute them in parallel
 		if (buffer.size() >= maxBufferSize or (buffer.size() > 0 and result == -1 ) ){
 
-			#pragma omp parallel for schedule(dynamic) shared(buffer,Pore_Substrate_Config,args,prog,failed) num_threads(args.threads)
+			std::vector< std::unique_ptr< DNAscent::read > > reads(buffer.size());
+			#pragma omp parallel for schedule(dynamic) shared(buffer,reads) num_threads(args.threads)
 			for (unsigned int i = 0; i < buffer.size(); i++){
 
-				DNAscent::read r(buffer[i], bam_hdr, readID2path, reference);
+				reads[i].reset(new DNAscent::read(buffer[i], bam_hdr, readIndex, reference));
+			}
 
-				const char *ext = get_ext(r.filename.c_str());
-				
-				if (strcmp(ext,"pod5") == 0){
-					pod5_getSignal(r);
+			//reads from the same pod5 or fast5 file are fetched together so the file is only opened (and its batches only
+			//decoded) once, but a file with more than its share of the buffer is split between threads
+			std::vector< DNAscent::read * > pod5Reads, fast5Reads;
+			for (auto &r : reads){
+
+				const char *ext = get_ext(r -> filename.c_str());
+				if (strcmp(ext,"pod5") == 0) pod5Reads.push_back(r.get());
+				else if (strcmp(ext,"fast5") == 0) fast5Reads.push_back(r.get());
+			}
+			size_t share = std::max( (size_t) 1, (pod5Reads.size() + fast5Reads.size() + args.threads - 1) / args.threads );
+			std::vector< std::vector< DNAscent::read * > > fetchGroups;
+			size_t fast5Groups = 0;
+			for (auto &sameFile : sortReadsByFilename(fast5Reads)){
+				for (size_t j = 0; j < sameFile.size(); j += share){
+					fetchGroups.emplace_back(sameFile.begin() + j, sameFile.begin() + std::min(j + share, sameFile.size()));
+					fast5Groups++;
 				}
-				else if (strcmp(ext,"fast5") == 0){
-					fast5_getSignal(r);
+			}
+			for (auto &sameFile : sortReadsByFilename(pod5Reads)){
+				for (size_t j = 0; j < sameFile.size(); j += share){
+					fetchGroups.emplace_back(sameFile.begin() + j, sameFile.begin() + std::min(j + share, sameFile.size()));
 				}
+			}
+
+			#pragma omp parallel for schedule(dynamic) shared(fetchGroups) num_threads(args.threads)
+			for (unsigned int i = 0; i < fetchGroups.size(); i++){
+
+				if (i < fast5Groups) fast5_getSignal_batch(fetchGroups[i]);
+				else pod5_getSignal_batch(fetchGroups[i]);
+			}
+
+			#pragma omp parallel for schedule(dynamic) shared(reads,Pore_Substrate_Config,args,prog,failed) num_threads(args.threads)
+			for (unsigned int i = 0; i < reads.size(); i++){
+
+				DNAscent::read &r = *reads[i];
 
 				bool useFitPoreModel = false;
 				normaliseEvents(r, useFitPoreModel);
@@ -866,12 +921,12 @@ int align_main( int argc, char** argv ){
 				{
 					outFile << r.humanReadable_eventalignOut;
 					prog++;
-					pb.displayProgress( prog, failed, failedEvents );
+					pb.displayProgress( progressFraction(), prog, failed, failedEvents );
 				}
 			}
 			buffer.clear();
 		}
-		pb.displayProgress( prog, failed, failedEvents );
+		pb.displayProgress( progressFraction(), prog, failed, failedEvents );
 		if (args.capReads and prog > args.maxReads){
 			bam_destroy1(itr_record);
 			bam_hdr_destroy(bam_hdr);
@@ -883,6 +938,8 @@ int align_main( int argc, char** argv ){
 	bam_hdr_destroy(bam_hdr);
 	hts_close(bam_fh);
 	std::cout << std::endl;
+	pod5_closeCachedFiles();
 	pod5_terminate();
+	fast5_closeCachedFiles();
 	return 0;
 }
@@ -176,3 +176,24 @@ const char *get_ext(const char *filename){
 	if(!ext || ext == filename) return "";
 	return ext + 1;
 }
+
+
+void parseShard( std::string shard, unsigned int &shardIndex, unsigned int &numShards ){
+/*parses a shard given on the command line as i/N, where shards are numbered from 0 */
+
+	std::vector< std::string > fields = split( shard, '/' );
+	if ( fields.size() != 2 ) throw InvalidShard( shard );
+
+	int i, N;
+	try{
+		i = std::stoi( fields[0] );
+		N = std::stoi( fields[1] );
+	}
+	catch ( const std::exception & ){
+		throw InvalidShard( shard );
+	}
+	if ( N < 1 or i < 0 or i >= N ) throw InvalidShard( shard );
+
+	shardIndex = i;
+	numShards = N;
+}
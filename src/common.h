@@ -34,6 +34,44 @@ class progressBar{
 		unsigned int _digits;
 		bool _withFail;
 
+		void draw( double progress, unsigned int currentNumber, unsigned int failed ){
+
+			_currentTime = std::chrono::steady_clock::now();
+			 std::chrono::duration<double> elapsedTime = _currentTime - _startTime;
+
+			std::cout << "[";
+			unsigned int pos = barWidth * progress;
+			for (unsigned int i = 0; i < barWidth; ++i) {
+				if (i < pos) std::cout << "=";
+				else if (i == pos) std::cout << ">";
+				else std::cout << " ";
+			}
+			std::cout << "] " << std::right << std::setw(3) << int(progress * 100.0) << "%  ";
+
+			if (maxNumber > 0) std::cout << std::right << std::setw(_digits) << currentNumber << "/" << maxNumber << "  ";
+			else std::cout << std::right << std::setw(_digits) << currentNumber << " reads  ";
+
+			unsigned int estTimeLeft = 0;
+			if (progress > 0.0) estTimeLeft = elapsedTime.count() * ( 1.0 / progress - 1.0 );
+			unsigned int hours = estTimeLeft / 3600;
+			unsigned int mins = (estTimeLeft % 3600) / 60;
+			unsigned int secs = (estTimeLeft % 3600) % 60;
+
+			if (_withFail){
+
+				std::cout << std::right << std::setw(2) << hours << "hr" << std::setw(2) << mins << "min" << std::setw(2) << secs << "sec  ";
+				std::cout << "failed: " << std::right << std::setw(_digits) << failed << std::setw(3) << "\r";
+
+				//testing
+				//std::cout << "  fe: " << std::right << std::setw(_digits) << failedEvents << std::setw(3) << "\r";
+			}
+			else{
+
+				std::cout << std::right << std::setw(2) << hours << "hr" << std::setw(2) << mins << "min" << std::setw(2) << secs << "sec  " << "\r";
+			}
+			std::cout.flush();
+		}
+
 	public:
 		progressBar( unsigned int maxNumber, bool withFail ){
 		
@@ -42,46 +80,23 @@ class progressBar{
 			_startTime = std::chrono::steady_clock::now();
 			_withFail = withFail;
 		}
-		void displayProgress( unsigned int currentNumber, unsigned int failed, int failedEvents ){
+		//for when the total isn't known up front and progress is estimated as we go
+		progressBar( bool withFail ){
 
-			_currentTime = std::chrono::steady_clock::now();
-			 std::chrono::duration<double> elapsedTime = _currentTime - _startTime;
+			maxNumber = 0;
+			_digits = 8;
+			_startTime = std::chrono::steady_clock::now();
+			_withFail = withFail;
+		}
+		void displayProgress( unsigned int currentNumber, unsigned int failed, int failedEvents ){
 
 			double progress = (double) currentNumber / (double) maxNumber;
-			
-			if ( progress <= 1.0 ){
-
-				std::cout << "[";
-				unsigned int pos = barWidth * progress;
-				for (unsigned int i = 0; i < barWidth; ++i) {
-					if (i < pos) std::cout << "=";
-					else if (i == pos) std::cout << ">";
-					else std::cout << " ";
-				}
-				std::cout << "] " << std::right << std::setw(3) << int(progress * 100.0) << "%  ";
-
-				std::cout << std::right << std::setw(_digits) << currentNumber << "/" << maxNumber << "  ";
-
-				unsigned int estTimeLeft = elapsedTime.count() * ( (double) maxNumber / (double) currentNumber - 1.0 );			
-				unsigned int hours = estTimeLeft / 3600;
-				unsigned int mins = (estTimeLeft % 3600) / 60;
-				unsigned int secs = (estTimeLeft % 3600) % 60;
-
-				if (_withFail){
-
-					std::cout << std::right << std::setw(2) << hours << "hr" << std::setw(2) << mins << "min" << std::setw(2) << secs << "sec  ";
-					std::cout << "failed: " << std::right << std::setw(_digits) << failed << std::setw(3) << "\r";
-
-					//testing
-					//std::cout << "  fe: " << std::right << std::setw(_digits) << failedEvents << std::setw(3) << "\r";
-				}
-				else{
-
-					std::cout << std::right << std::setw(2) << hours << "hr" << std::setw(2) << mins << "min" << std::setw(2) << secs << "sec  " << "\r";
-				}
-				std::cout.flush();
-			}
-		} 
+			if ( progress <= 1.0 ) draw( progress, currentNumber, failed );
+		}
+		void displayProgress( double progress, unsigned int currentNumber, unsigned int failed, int failedEvents ){
+
+			draw( std::min( std::max( progress, 0.0 ), 1.0 ), currentNumber, failed );
+		}
 };
 
 
@@ -189,5 +204,6 @@ std::vector<double> movingAvgFilter(std::vector<double> &, unsigned int);
 std::vector<double> movingAvgFilterLogistic(std::vector<double> &, unsigned int);
 std::vector<double> normVectorSum(std::vector<double>);
 const char *get_ext(const char *);
+void parseShard( std::string, unsigned int &, unsigned int & );
 
 #endif
@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libgen.h>
 #include <iostream>
 #include <ctime>
@@ -314,27 +316,254 @@ std::vector< std::pair< double, double > > import_poreModel_fitStdv( std::string
 	return indexedPoreModel;
 }
 
-void parseIndex( std::string indexFilename, std::map< std::string, IndexEntry > &readID2entry ){
+//a binary index starts with this, followed by the version, the number of paths and entries, and then the path table
+//(each path's length followed by its characters and, from version 2, the file's size, mtime, and inode) and the sorted
+//entries, which start on an 8-byte boundary
+static const char binaryIndexMagic[8] = {'D','N','A','S','I','D','X','\0'};
+static const uint32_t binaryIndexVersion = 2;
+
+struct BinaryIndexHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t numPaths;
+	uint64_t numEntries;
+	uint64_t entriesOffset;
+};
+
+
+static int hexValue( char c ){
+
+	if (c >= '0' and c <= '9') return c - '0';
+	if (c >= 'a' and c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' and c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+bool parseUUID( const std::string &readID, uint8_t *uuid ){
+/*packs a readID of the form 8-4-4-4-12 hex digits into 16 bytes - returns false for anything else */
+
+	if (readID.size() != 36) return false;
+	size_t b = 0;
+	for (size_t i = 0; i < readID.size(); ){
+
+		if (i == 8 or i == 13 or i == 18 or i == 23){
+			if (readID[i] != '-') return false;
+			i++;
+			continue;
+		}
+		int hi = hexValue(readID[i]), lo = hexValue(readID[i+1]);
+		if (hi < 0 or lo < 0) return false;
+		uuid[b++] = (uint8_t) (hi << 4 | lo);
+		i += 2;
+	}
+	return true;
+}
+
+
+static bool uuidLess( const BinaryIndexEntry &a, const BinaryIndexEntry &b ){
+
+	return memcmp(a.uuid, b.uuid, sizeof(a.uuid)) < 0;
+}
+
+
+bool statSignalFile( const std::string &path, SignalFileStat &fileStat ){
+
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0) return false;
+	fileStat.size = st.st_size;
+	fileStat.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	fileStat.inode = st.st_ino;
+	return true;
+}
+
+
+bool writeBinaryIndex( const std::string &indexFilename, const std::vector< std::string > &paths, const std::vector< SignalFileStat > &stats, std::vector< BinaryIndexEntry > &entries, size_t sortedPrefix ){
+/*sorts the entries and writes them out with the path table - if a readID is in the index twice, the later one is kept,
+ *as it was with text indexes - the first sortedPrefix entries are already sorted (e.g. kept from an earlier index), so
+ *only the rest need sorting before the two are merged */
+
+	assert(stats.size() == paths.size());
+	sortedPrefix = std::min(sortedPrefix, entries.size());
+	std::stable_sort(entries.begin() + sortedPrefix, entries.end(), uuidLess);
+	std::inplace_merge(entries.begin(), entries.begin() + sortedPrefix, entries.end(), uuidLess);
+	std::vector< BinaryIndexEntry > unique;
+	unique.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); i++){
+		if (i + 1 < entries.size() and not uuidLess(entries[i], entries[i+1])) continue;
+		unique.push_back(entries[i]);
+	}
+
+	std::ofstream outFile(indexFilename, std::ios::binary);
+	if ( not outFile.is_open() ) return false;
+
+	BinaryIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, binaryIndexMagic, sizeof(header.magic));
+	header.version = binaryIndexVersion;
+	header.numPaths = paths.size();
+	header.numEntries = unique.size();
+
+	uint64_t pathBytes = 0;
+	for (auto &p : paths) pathBytes += sizeof(uint32_t) + p.size() + sizeof(SignalFileStat);
+	header.entriesOffset = (sizeof(header) + pathBytes + 7) / 8 * 8;
+
+	outFile.write((const char *) &header, sizeof(header));
+	for (size_t i = 0; i < paths.size(); i++){
+		uint32_t length = paths[i].size();
+		outFile.write((const char *) &length, sizeof(length));
+		outFile.write(paths[i].data(), length);
+		outFile.write((const char *) &stats[i], sizeof(SignalFileStat));
+	}
+	const char padding[8] = {0};
+	outFile.write(padding, header.entriesOffset - sizeof(header) - pathBytes);
+	outFile.write((const char *) unique.data(), unique.size() * sizeof(BinaryIndexEntry));
+	outFile.close();
+	return outFile.good();
+}
+
+
+SignalIndex::~SignalIndex( void ){
+
+	if (map != NULL) munmap((void *) map, mapSize);
+}
+
+
+void SignalIndex::loadBinary( const std::string &indexFilename, int fd ){
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 or (size_t) st.st_size < sizeof(BinaryIndexHeader)) throw IOerror( indexFilename );
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) throw IOerror( indexFilename );
+	map = (const char *) m;
+	mapSize = st.st_size;
+
+	BinaryIndexHeader header;
+	memcpy(&header, map, sizeof(header));
+	if (header.version < 1 or header.version > binaryIndexVersion) throw IOerror( indexFilename );
+	if (header.entriesOffset > mapSize or header.numEntries > (mapSize - header.entriesOffset) / sizeof(BinaryIndexEntry)) throw IOerror( indexFilename );
+
+	size_t pos = sizeof(header);
+	for (uint64_t i = 0; i < header.numPaths; i++){
+
+		uint32_t length;
+		if (pos + sizeof(length) > header.entriesOffset) throw IOerror( indexFilename );
+		memcpy(&length, map + pos, sizeof(length));
+		pos += sizeof(length);
+		if (pos + length > header.entriesOffset) throw IOerror( indexFilename );
+		paths.emplace_back(map + pos, length);
+		pos += length;
+
+		//version 1 indexes didn't record what the files looked like
+		if (header.version >= 2){
+			SignalFileStat fileStat;
+			if (pos + sizeof(fileStat) > header.entriesOffset) throw IOerror( indexFilename );
+			memcpy(&fileStat, map + pos, sizeof(fileStat));
+			pos += sizeof(fileStat);
+			stats.push_back(fileStat);
+		}
+	}
+
+	entries = (const BinaryIndexEntry *) (map + header.entriesOffset);
+	numEntries = header.numEntries;
+
+	//lookups land anywhere in the table
+	madvise((void *) m, mapSize, MADV_RANDOM);
+}
+
+
+void SignalIndex::loadText( const std::string &indexFilename, const std::unordered_set< std::string > *only ){
+/*if only is given, entries for any other reads are skipped so memory scales with the reads that will be looked up */
 
-	std::cout << "Loading DNAscent index... ";
 	std::ifstream indexFile( indexFilename );
 	if ( not indexFile.is_open() ) throw IOerror( indexFilename );
 	std::string line;
 
+	//each path is only stored once, however many reads are in the file
+	std::unordered_map< std::string, uint32_t > pathIDs;
+
 	//get the readID to path map
 	while ( std::getline( indexFile, line) ){
-	
-		std::stringstream ss_line(line);
-		std::string readID, batch_str, row_str, path;
-		
-		std::getline(ss_line,readID,'\t');
-		std::getline(ss_line,batch_str,'\t');		
-		std::getline(ss_line,row_str,'\t');		
-		std::getline(ss_line,path,'\n');
-		
-		struct IndexEntry i = {stoul(batch_str), stoul(row_str), path};
-		readID2entry[readID] = i;
+
+		size_t tab1 = line.find('\t');
+		size_t tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+		size_t tab3 = tab2 == std::string::npos ? tab2 : line.find('\t', tab2 + 1);
+		if (tab3 == std::string::npos) continue;
+
+		std::string readID = line.substr(0, tab1);
+		if (only != NULL and only -> count(readID) == 0) continue;
+
+		std::string path = line.substr(tab3 + 1);
+		auto p = pathIDs.find(path);
+		if (p == pathIDs.end()){
+			p = pathIDs.emplace(path, paths.size()).first;
+			paths.push_back(path);
+		}
+
+		TextEntry e;
+		e.file = p -> second;
+		e.batch = stoul(line.substr(tab1 + 1, tab2 - tab1 - 1));
+		e.row = stoul(line.substr(tab2 + 1, tab3 - tab2 - 1));
+		textEntries[readID] = e;
 	}
-	
+}
+
+
+bool SignalIndex::isBinaryFile( const std::string &indexFilename ){
+/*works out whether the index is binary or text from its first bytes */
+
+	int fd = open(indexFilename.c_str(), O_RDONLY);
+	if (fd < 0) throw IOerror( indexFilename );
+
+	char magic[sizeof(binaryIndexMagic)];
+	bool binary = pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) and memcmp(magic, binaryIndexMagic, sizeof(magic)) == 0;
+	close(fd);
+	return binary;
+}
+
+
+void SignalIndex::load( const std::string &indexFilename, const std::unordered_set< std::string > *only ){
+/*binary indexes are only ever read where they're looked up, so only is just used to cut down a text index */
+
+	if (isBinaryFile(indexFilename)){
+
+		int fd = open(indexFilename.c_str(), O_RDONLY);
+		if (fd < 0) throw IOerror( indexFilename );
+		loadBinary(indexFilename, fd);
+		close(fd);
+	}
+	else loadText(indexFilename, only);
+}
+
+
+bool SignalIndex::find( const std::string &readID, IndexEntry &entry ) const {
+
+	if (map != NULL){
+
+		BinaryIndexEntry key;
+		if (not parseUUID(readID, key.uuid)) return false;
+		const BinaryIndexEntry *e = std::lower_bound(entries, entries + numEntries, key, uuidLess);
+		if (e == entries + numEntries or memcmp(e -> uuid, key.uuid, sizeof(key.uuid)) != 0 or e -> file >= paths.size()) return false;
+
+		entry.filepath = paths[e -> file];
+		entry.batchIndex = e -> batch == UINT32_MAX ? (size_t) -1 : e -> batch;
+		entry.rowIndex = e -> row == UINT32_MAX ? (size_t) -1 : e -> row;
+		return true;
+	}
+
+	auto e = textEntries.find(readID);
+	if (e == textEntries.end()) return false;
+	entry.filepath = paths[e -> second.file];
+	entry.batchIndex = e -> second.batch;
+	entry.rowIndex = e -> second.row;
+	return true;
+}
+
+
+void parseIndex( std::string indexFilename, SignalIndex &readIndex, const std::unordered_set< std::string > *only ){
+
+	std::cout << "Loading DNAscent index... ";
+	readIndex.load(indexFilename, only);
 	std::cout << "ok." << std::endl;
 }
@@ -15,6 +15,8 @@
 #include <iostream>
 #include <cassert>
 #include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
 #include <omp.h>
 
 
@@ -34,6 +36,73 @@ std::string getGitCommit(void);
 std::string writeDetectHeader(std::string, std::string, std::string, int, bool, unsigned int, unsigned int, bool);
 std::string writeRegionsHeader(std::string, double, bool, unsigned int, unsigned int, double, double);
 unsigned int kmer2index(std::string &, unsigned int);
-void parseIndex( std::string, std::map< std::string, IndexEntry > & );
+
+
+//one read in a binary DNAscent index - entries are sorted by the readID's 16 UUID bytes so they can be binary searched
+struct BinaryIndexEntry{
+	uint8_t uuid[16];
+	uint32_t file;						//position in the index's path table
+	uint32_t batch;						//UINT32_MAX for fast5, which has no batches or rows
+	uint32_t row;
+	uint32_t reserved;
+};
+
+
+//what a signal file looked like when it was indexed, so that index --update can tell whether it has changed since
+struct SignalFileStat{
+	uint64_t size = 0;
+	int64_t mtime = 0;					//nanoseconds since the epoch
+	uint64_t inode = 0;
+
+	bool operator==( const SignalFileStat &other ) const {
+		return size == other.size and mtime == other.mtime and inode == other.inode;
+	}
+};
+
+
+//readID -> signal file, batch, and row for every read in a DNAscent index
+//binary indexes are mapped into memory and searched in place, so loading costs nothing and only the pages that lookups
+//touch are read - text indexes (from older versions, or with readIDs that aren't UUIDs) are parsed into a hash map
+class SignalIndex{
+
+	private:
+		struct TextEntry{
+			uint32_t file;
+			size_t batch, row;
+		};
+
+		std::vector< std::string > paths;
+		std::vector< SignalFileStat > stats;			//one per path, or empty if the index doesn't have them
+		const char *map = NULL;
+		size_t mapSize = 0;
+		const BinaryIndexEntry *entries = NULL;
+		size_t numEntries = 0;
+		std::unordered_map< std::string, TextEntry > textEntries;
+
+		void loadBinary( const std::string &, int );
+		void loadText( const std::string &, const std::unordered_set< std::string > * );
+
+	public:
+		SignalIndex( void ){}
+		SignalIndex( const SignalIndex & ) = delete;
+		SignalIndex &operator=( const SignalIndex & ) = delete;
+		~SignalIndex( void );
+		static bool isBinaryFile( const std::string & );
+		void load( const std::string &, const std::unordered_set< std::string > *only = NULL );
+		bool find( const std::string &, IndexEntry & ) const;
+		size_t size( void ) const { return map ? numEntries : textEntries.size(); }
+
+		//for index --update, which only works from a binary index
+		bool isBinary( void ) const { return map != NULL; }
+		const std::vector< std::string > &filePaths( void ) const { return paths; }
+		const std::vector< SignalFileStat > &fileStats( void ) const { return stats; }
+		const BinaryIndexEntry *binaryEntries( void ) const { return entries; }
+};
+
+
+bool parseUUID( const std::string &, uint8_t * );
+bool statSignalFile( const std::string &, SignalFileStat & );
+bool writeBinaryIndex( const std::string &, const std::vector< std::string > &, const std::vector< SignalFileStat > &, std::vector< BinaryIndexEntry > &, size_t sortedPrefix = 0 );
+void parseIndex( std::string, SignalIndex &, const std::unordered_set< std::string > *only = NULL );
 
 #endif
@@ -16,6 +16,9 @@
 #include <math.h>
 #include <stdlib.h>
 #include <limits>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
 #include "detect.h"
 #include "common.h"
 #include "event_handling.h"
@@ -30,6 +33,8 @@
 #include "htsInterface.h"
 #include "error_handling.h"
 #include "config.h"
+#include "pipeline.h"
+#include "profile.h"
 #include <omp.h>
 #include <slow5/slow5.h>
 
@@ -41,13 +46,35 @@ static const char *help=
 "Required arguments are:\n"
 "  -b,--bam                  path to alignment BAM file,\n"
 "  -r,--reference            path to genome reference in fasta format,\n"
-"  -i,--index                path to DNAscent index,\n"
-"  -o,--output               path to output file with extension `detect` (for human-readable format) or `bam` (for modbam format).\n"
+"  -i,--index                path to DNAscent index, or to a slow5/blow5 file (or a comma-separated list of them),\n"
+"  -o,--output               path to output file with extension `detect` (for human-readable format), `bam` (for modbam format), or `cram` (for modbam format compressed against the reference).\n"
 "Optional arguments are:\n"
 "  -t,--threads              number of threads (default is 1 thread),\n"
+"  --io-threads              number of threads for bam/cram compression and decompression (default is 2 threads),\n"
 "  --GPU                     use the GPU device indicated for prediction (default is CPU),\n"
+"  --cnn-batch               maximum number of reads per CNN call, only reads with the same number of positions share a call (default is 16),\n"
+"  --pod5-cache-files        number of pod5 files each thread keeps open (default is 4),\n"
+"  --pod5-cache-batches      number of decoded pod5 read batches each thread keeps (default is 16),\n"
+"  --fast5-cache-files       number of fast5 files each thread keeps open (default is 4),\n"
+"  --fast5-workers           number of separate processes that decode fast5 files, which avoids HDF5's global lock (default is 0, decode on the signal threads),\n"
+"  --prefetch-reads          number of reads to fetch signal for ahead of the compute threads (default is 4 reads per thread),\n"
+"  --prefetch-mb             stop fetching ahead once this many MB of signal are waiting for the compute threads (default is no limit),\n"
+"  --prefetch-threads        number of threads that fetch signal from pod5/fast5/slow5 files (default is the same as --threads),\n"
+"  --sequential              read pod5 files front to back, for a bam with reads in about the same order as the pod5 files (e.g., unsorted Dorado output),\n"
+"  --slow5-access            how reads are taken from blow5 files, `random` (default), `sequential` if the bam is in the same order as the blow5, or `willneed` to read whole files into memory,\n"
+"  --index-from-bam          read the bam once first and only load the index entries for reads that will be run, for a text index and a bam that's a small part of a big run,\n"
+"  --profile                 write a json report of time spent in each stage, read latencies, and bytes read to this file,\n"
+"  --checkpoint-interval     seconds between checkpoints that --resume can restart from, 0 to turn off (default is 300),\n"
+"  --resume                  carry on from the last checkpoint of an interrupted run with the same arguments,\n"
 "  -q,--quality              minimum mapping quality (default is 20),\n"
-"  -l,--length               minimum read length in bp (default is 1000).\n"
+"  -l,--length               minimum read length in bp (default is 1000),\n"
+"  --exclude-flags           skip records with any of these bam flags set (default is 0x904: unmapped, secondary, and supplementary),\n"
+"  --read-ids                only run on the readIDs listed in this file, one per line,\n"
+"  --exclude-read-ids        skip the readIDs listed in this file, one per line,\n"
+"  --region                  only run on reads overlapping this region (chr:start-end), can be given more than once,\n"
+"  --regions                 only run on reads overlapping the regions in this bed file,\n"
+"  --region-shard            run only shard i of N (given as i/N, 0 <= i < N) of the regions, or of the references if no regions are given,\n"
+"  --shard                   run only shard i of N (given as i/N, 0 <= i < N) of the reads, assigned by readID so that split reads stay with their parent.\n"
 "DNAscent is under active development by the Boemo Group, Department of Pathology, University of Cambridge (https://www.boemogroup.org/).\n"
 "Please submit bug reports to GitHub Issues (https://github.com/MBoemo/DNAscent/issues).";
 
@@ -57,12 +84,36 @@ struct Arguments_detect {
 	std::string outputFilename;
 	std::string indexFilename;
 	bool humanReadable = false;
+	bool cram = false;
 	bool useGPU = false;
 	bool useHMM = false;
 	unsigned char GPUdevice = '0';
 	int minQ = 20;
 	int minL = 1000;
+	uint16_t excludeFlags = defaultExcludeFlags;
+	std::string readIDsFilename;
+	std::string excludeReadIDsFilename;
 	unsigned int threads = 1;
+	unsigned int ioThreads = 2;
+	unsigned int cnnBatch = 16;
+	unsigned int pod5CacheFiles = 4;
+	unsigned int pod5CacheBatches = 16;
+	unsigned int fast5CacheFiles = 4;
+	unsigned int fast5Workers = 0;
+	unsigned int prefetchReads = 0;				//0 means 4 per thread
+	unsigned int prefetchMB = 0;				//0 means no limit
+	unsigned int prefetchThreads = 0;			//0 means the same as threads
+	Slow5Access slow5Access = Slow5Access::Random;
+	bool sequential = false;
+	bool indexFromBam = false;
+	std::string profileFilename;
+	unsigned int checkpointInterval = 300;
+	bool resume = false;
+	std::vector< std::string > regions;
+	std::string regionsFilename;
+	bool shardByRegion = false;
+	unsigned int regionShard = 0, numRegionShards = 1;
+	unsigned int readShard = 0, numReadShards = 1;
 };
 
 Arguments_detect parseDetectArguments_detect( int argc, char** argv ){
@@ -115,6 +166,14 @@ Arguments_detect parseDetectArguments_detect( int argc, char** argv ){
 			args.threads = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--io-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.ioThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
 		else if ( flag == "-q" or flag == "--quality" ){
 
 			if (i == argc-1) throw TrailingFlag(flag);
@@ -157,6 +216,10 @@ Arguments_detect parseDetectArguments_detect( int argc, char** argv ){
 			if (strcmp(ext,"bam") == 0){
 				args.humanReadable = false;
 			}
+			else if (strcmp(ext,"cram") == 0){
+				args.humanReadable = false;
+				args.cram = true;
+			}
 			else if (strcmp(ext,"detect") == 0){
 				args.humanReadable = true;
 			}
@@ -167,6 +230,173 @@ Arguments_detect parseDetectArguments_detect( int argc, char** argv ){
 			args.outputFilename = strArg;
 			i+=2;
 		}
+		else if ( flag == "--cnn-batch" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			int batch = std::stoi( strArg.c_str() );
+
+			if (batch < 1) throw InvalidBatchSize();
+
+			args.cnnBatch = batch;
+			i+=2;
+		}
+		else if ( flag == "--profile" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.profileFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "--checkpoint-interval" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.checkpointInterval = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--resume" ){
+
+			args.resume = true;
+			i+=1;
+		}
+		else if ( flag == "--region" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.regions.push_back(strArg);
+			i+=2;
+		}
+		else if ( flag == "--regions" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.regionsFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "--pod5-cache-files" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.pod5CacheFiles = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--pod5-cache-batches" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.pod5CacheBatches = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--fast5-cache-files" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.fast5CacheFiles = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--fast5-workers" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.fast5Workers = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--prefetch-reads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.prefetchReads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--prefetch-mb" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.prefetchMB = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--prefetch-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.prefetchThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--sequential" ){
+
+			args.sequential = true;
+			i+=1;
+		}
+		else if ( flag == "--index-from-bam" ){
+
+			args.indexFromBam = true;
+			i+=1;
+		}
+		else if ( flag == "--slow5-access" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			if (strArg == "random") args.slow5Access = Slow5Access::Random;
+			else if (strArg == "sequential") args.slow5Access = Slow5Access::Sequential;
+			else if (strArg == "willneed") args.slow5Access = Slow5Access::WillNeed;
+			else throw InvalidOption(flag + " " + strArg);
+			i+=2;
+		}
+		else if ( flag == "--exclude-flags" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.excludeFlags = std::stoi( strArg.c_str(), nullptr, 0 );
+			i+=2;
+		}
+		else if ( flag == "--read-ids" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.readIDsFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "--exclude-read-ids" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.excludeReadIDsFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "--region-shard" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			parseShard(strArg, args.regionShard, args.numRegionShards);
+			args.shardByRegion = true;
+			i+=2;
+		}
+		else if ( flag == "--shard" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			parseShard(strArg, args.readShard, args.numReadShards);
+			i+=2;
+		}
 		else if ( flag == "--HMM" ){
 		
 			args.useHMM = true;
@@ -187,6 +417,10 @@ Arguments_detect parseDetectArguments_detect( int argc, char** argv ){
 		else throw InvalidOption( flag );
 	}
 	if (args.outputFilename == args.indexFilename or args.outputFilename == args.referenceFilename or args.outputFilename == args.bamFilename) throw OverwriteFailure();
+	if (args.profileFilename == args.outputFilename or args.profileFilename == args.indexFilename or args.profileFilename == args.referenceFilename or args.profileFilename == args.bamFilename) throw OverwriteFailure();
+
+	if (args.prefetchReads == 0) args.prefetchReads = 4*args.threads;
+	if (args.prefetchThreads == 0) args.prefetchThreads = args.threads;
 
 	return args;
 }
@@ -549,7 +783,79 @@ std::cerr << logLikelihoodRatio << std::endl;
 }
 
 
-void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vector<TF_Output> inputOps, bool humanReadable){
+//most positions (summed over the reads in a bucket) in a single session call, so that a bucket of long reads doesn't make an enormous signal tensor
+static const size_t maxPositionsPerCNNCall = 500000;
+
+
+//write the CNN output for one read - output_array points to the first position of this read in the output tensor
+static void scatterCNNOutput(DNAscent::read &r, const float *output_array, bool humanReadable){
+
+	unsigned int outputFields = 3;
+
+	//get positions on the read reference to write the output
+	std::vector<unsigned int> refCoordinates = r.getReferenceCoords();
+	std::vector<unsigned int> refIndices = r.getReferenceIndices();
+	std::vector<unsigned int> queryIndices = r.getQueryIndices();
+	std::vector<std::string> kmers = r.getKmers();
+
+	size_t output_size = r.getSequenceShape()[0] * outputFields;
+
+	//write the output
+	unsigned int pos_ctr = 0;
+	std::vector<std::string> lines;
+	lines.reserve(refCoordinates.size());
+	unsigned int thisRefCoord = refCoordinates[0];
+	std::string str_line;
+	
+	if (humanReadable) r.humanReadable_detectOut += ">" + r.readID + " " + r.referenceMappedTo + " " + std::to_string(r.refStart) + " " + std::to_string(r.refEnd) + " " + r.strand + "\n";
+	
+	for(size_t i = 0; i < output_size; i++){
+		if((i+1)%outputFields==0){
+
+			//only output kmers where the middle position is a T
+			if (kmers[pos_ctr].substr(4,1) != "T"){ 
+				pos_ctr++;
+				continue;
+			}
+			
+			r.refCoordToCalls[thisRefCoord] = std::make_pair(output_array[i], output_array[i-1]);
+
+			if (humanReadable){
+				str_line += std::to_string(thisRefCoord) + "\t" + std::to_string(output_array[i])+ "\t" + std::to_string(output_array[i-1]);
+				if (r.isReverse) str_line += "\t" + reverseComplement(kmers[pos_ctr]);
+				else str_line += "\t" + kmers[pos_ctr];
+				lines.push_back(str_line);
+				str_line = "";
+			}
+			else if ( not r.refToDel.at(refIndices[pos_ctr]) ){
+			
+				r.queryIndexToCalls[queryIndices[pos_ctr]] = std::make_pair(output_array[i], output_array[i-1]);			
+			}
+			
+			pos_ctr++;
+		}
+		else{
+			if (i != output_size-1) thisRefCoord = refCoordinates[pos_ctr];
+		}
+	}
+
+	if (humanReadable){
+		if (r.isReverse) std::reverse(lines.begin(),lines.end());
+
+		for (auto s = lines.begin(); s < lines.end(); s++){
+			r.humanReadable_detectOut += *s + "\n";
+		}
+	}
+	else{
+	
+		r.writeModBamTag();
+	}
+}
+
+
+
+//run the CNN on reads that all have the same number of positions as one batch
+static void runCNN_bucket(std::vector<DNAscent::read *> &bucket, std::shared_ptr<ModelSession> session, std::vector<TF_Output> inputOps, bool humanReadable){
 
 	int NumInputs = 3;
 	int NumOutputs = 1;
@@ -557,20 +863,40 @@ void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vecto
 	std::vector<TF_Tensor*> input_tensors;
 	TF_Tensor* OutputValues;
 
-	//core sequence input
-	std::vector<size_t> protoSequenceShape = r.getSequenceShape();
-	TensorShape input_sequenceShape={{1, (int64_t) protoSequenceShape[0]}, 2};
+	ProfileTimer buildTimer(ProfileStage::TensorBuild);
+
+	int64_t batchSize = bucket.size();
+	size_t maxLength = bucket[0] -> getSequenceShape()[0];
+	assert(maxLength > 0);
+
+	//the model has no masking and sequence index 0 is a real k-mer, so padding would change the calls of shorter reads - 
+	//every read in a bucket must fill its whole row of the tensor
+	for (auto r : bucket) assert(r -> getSequenceShape()[0] == maxLength);
+
+	std::vector<size_t> protoSignalShape = bucket[0] -> getSignalShape();
+	size_t signalPerPosition = protoSignalShape[1] * protoSignalShape[2];
 
-	std::vector<float> unformattedCoreSequenceTensor = r.makeCoreSequenceTensor();
+	size_t sizeSequence = batchSize * maxLength;
+	size_t sizeSignal = sizeSequence * signalPerPosition;
+	float *tmp_coreSequenceArray = new float[sizeSequence]();
+	float *tmp_resSequenceArray = new float[sizeSequence]();
+	float *tmp_signalArray = new float[sizeSignal]();
 
-	size_t sizeSequence = unformattedCoreSequenceTensor.size();
-	assert(sizeSequence > 0);
+	for (int64_t b = 0; b < batchSize; b++){
 
-	float *tmp_coreSequenceArray = (float *)malloc(sizeSequence*sizeof(float));
-	for(size_t i = 0; i < sizeSequence; i++){
-		tmp_coreSequenceArray[i] = unformattedCoreSequenceTensor[i];
+		std::vector<float> unformattedCoreSequenceTensor = bucket[b] -> makeCoreSequenceTensor();
+		std::copy(unformattedCoreSequenceTensor.begin(), unformattedCoreSequenceTensor.end(), tmp_coreSequenceArray + b*maxLength);
+
+		std::vector<float> unformattedResidualSequenceTensor = bucket[b] -> makeResidualSequenceTensor();
+		std::copy(unformattedResidualSequenceTensor.begin(), unformattedResidualSequenceTensor.end(), tmp_resSequenceArray + b*maxLength);
+
+		std::vector<float> unformattedSignalTensor = bucket[b] -> makeSignalTensor();
+		std::copy(unformattedSignalTensor.begin(), unformattedSignalTensor.end(), tmp_signalArray + b*maxLength*signalPerPosition);
 	}
 
+	//core sequence input
+	TensorShape input_sequenceShape={{batchSize, (int64_t) maxLength}, 2};
+
 	TF_Tensor* CoreSequenceInputTensor = TF_NewTensor(TF_FLOAT,
 		input_sequenceShape.values,
 		input_sequenceShape.dim,
@@ -582,13 +908,6 @@ void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vecto
 	input_tensors.push_back(CoreSequenceInputTensor);
 	
 	//residual sequence input (inherits the same shape as core sequence)
-	std::vector<float> unformattedResidualSequenceTensor = r.makeResidualSequenceTensor();
-
-	float *tmp_resSequenceArray = (float *)malloc(sizeSequence*sizeof(float));
-	for(size_t i = 0; i < sizeSequence; i++){
-		tmp_resSequenceArray[i] = unformattedResidualSequenceTensor[i];
-	}
-
 	TF_Tensor* ResidualSequenceInputTensor = TF_NewTensor(TF_FLOAT,
 		input_sequenceShape.values,
 		input_sequenceShape.dim,
@@ -600,18 +919,7 @@ void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vecto
 	input_tensors.push_back(ResidualSequenceInputTensor);
 
 	//signal input
-	std::vector<size_t> protoSignalShape = r.getSignalShape();
-	TensorShape input_signalShape={{1, (int64_t) protoSignalShape[0], (int64_t) protoSignalShape[1], (int64_t) protoSignalShape[2]}, 4};
-
-	std::vector<float> unformattedSignalTensor = r.makeSignalTensor();
-
-	size_t sizeSignal = unformattedSignalTensor.size();
-	assert(sizeSignal > 0);
-
-	float *tmp_signalArray = (float *)malloc(sizeSignal*sizeof(float));
-	for(size_t i = 0; i < sizeSignal; i++){
-		tmp_signalArray[i] = unformattedSignalTensor[i];
-	}
+	TensorShape input_signalShape={{batchSize, (int64_t) maxLength, (int64_t) protoSignalShape[1], (int64_t) protoSignalShape[2]}, 4};
 
 	TF_Tensor* SignalInputTensor = TF_NewTensor(TF_FLOAT,
 		input_signalShape.values,
@@ -623,9 +931,14 @@ void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vecto
 
 	input_tensors.push_back(SignalInputTensor);
 
+	buildTimer.stop();
+
 	//Run the Session
 	CStatus status;
-	TF_SessionRun(*(session->session.get()), NULL, &inputOps[0], &input_tensors[0], NumInputs, &session->outputs, &OutputValues, NumOutputs, NULL, 0, NULL, status.ptr);
+	{
+		ProfileTimer timer(ProfileStage::SessionRun);
+		TF_SessionRun(*(session->session.get()), NULL, &inputOps[0], &input_tensors[0], NumInputs, &session->outputs, &OutputValues, NumOutputs, NULL, 0, NULL, status.ptr);
+	}
 
 	if(TF_GetCode(status.ptr) != TF_OK)
 	{
@@ -637,88 +950,204 @@ void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vecto
 		exit (EXIT_FAILURE);
 	}
 
-	unsigned int outputFields = 3;
-
-	//get positions on the read reference to write the output
-	std::vector<unsigned int> refCoordinates = r.getReferenceCoords();
-	std::vector<unsigned int> refIndices = r.getReferenceIndices();
-	std::vector<unsigned int> queryIndices = r.getQueryIndices();
-	std::vector<std::string> kmers = r.getKmers();
+	ProfileTimer outputTimer(ProfileStage::CNNOutput);
 
+	unsigned int outputFields = 3;
 	size_t output_size = TF_TensorByteSize(OutputValues) / sizeof(float);
-	assert(output_size == protoSequenceShape[0] * outputFields);
+	assert(output_size == sizeSequence * outputFields);
 	float *output_array = (float *)TF_TensorData(OutputValues);
 
-	//write the output
-	unsigned int pos_ctr = 0;
-	std::vector<std::string> lines;
-	lines.reserve(refCoordinates.size());
-	unsigned int thisRefCoord = refCoordinates[0];
-	std::string str_line;
-	
-	if (humanReadable) r.humanReadable_detectOut += ">" + r.readID + " " + r.referenceMappedTo + " " + std::to_string(r.refStart) + " " + std::to_string(r.refEnd) + " " + r.strand + "\n";
-	
-	for(size_t i = 0; i < output_size; i++){
-		if((i+1)%outputFields==0){
+	//hand each read its slice of the output
+	for (int64_t b = 0; b < batchSize; b++){
 
-			//only output kmers where the middle position is a T
-			if (kmers[pos_ctr].substr(4,1) != "T"){ 
-				pos_ctr++;
-				continue;
-			}
-			
-			r.refCoordToCalls[thisRefCoord] = std::make_pair(output_array[i], output_array[i-1]);
-
-			if (humanReadable){
-				str_line += std::to_string(thisRefCoord) + "\t" + std::to_string(output_array[i])+ "\t" + std::to_string(output_array[i-1]);
-				if (r.isReverse) str_line += "\t" + reverseComplement(kmers[pos_ctr]);
-				else str_line += "\t" + kmers[pos_ctr];
-				lines.push_back(str_line);
-				str_line = "";
-			}
-			else if ( not r.refToDel.at(refIndices[pos_ctr]) ){
-			
-				r.queryIndexToCalls[queryIndices[pos_ctr]] = std::make_pair(output_array[i], output_array[i-1]);			
-			}
-			
-			pos_ctr++;
-		}
-		else{
-			if (i != output_size-1) thisRefCoord = refCoordinates[pos_ctr];
-		}
+		scatterCNNOutput(*bucket[b], output_array + b*maxLength*outputFields, humanReadable);
 	}
 
 	TF_DeleteTensor(OutputValues);
 	TF_DeleteTensor(CoreSequenceInputTensor);
 	TF_DeleteTensor(ResidualSequenceInputTensor);
 	TF_DeleteTensor(SignalInputTensor);
+}
 
-	if (humanReadable){
-		if (r.isReverse) std::reverse(lines.begin(),lines.end());
 
-		for (auto s = lines.begin(); s < lines.end(); s++){
-			r.humanReadable_detectOut += *s + "\n";
+void runCNN_batch(std::vector<DNAscent::read *> &reads, std::shared_ptr<ModelSession> session, std::vector<TF_Output> inputOps, bool humanReadable){
+
+	//reads are only run together if they have exactly the same number of positions, so no read is ever padded and each
+	//read's inputs are exactly what they'd be if it were run on its own
+	std::vector<DNAscent::read *> sorted = reads;
+	std::stable_sort(sorted.begin(), sorted.end(), [](DNAscent::read *a, DNAscent::read *b){ return a -> getSequenceShape()[0] < b -> getSequenceShape()[0]; });
+
+	std::vector<DNAscent::read *> bucket;
+	size_t bucketLength = 0;
+	for (auto r : sorted){
+
+		size_t length = r -> getSequenceShape()[0];
+		if ( bucket.size() > 0 and (length != bucketLength or length * (bucket.size() + 1) > maxPositionsPerCNNCall) ){
+
+			runCNN_bucket(bucket, session, inputOps, humanReadable);
+			bucket.clear();
 		}
+		bucket.push_back(r);
+		bucketLength = length;
 	}
-	else{
+	if (bucket.size() > 0) runCNN_bucket(bucket, session, inputOps, humanReadable);
+}
+
+
+void runCNN(DNAscent::read &r, std::shared_ptr<ModelSession> session, std::vector<TF_Output> inputOps, bool humanReadable){
+
+	std::vector<DNAscent::read *> reads = {&r};
+	runCNN_batch(reads, session, inputOps, humanReadable);
+}
+
+//most reads the signal stage takes from its queue at once - it only gets this many when it's behind
+static const size_t maxReadsPerSignalFetch = 32;
+
+//a single bam record as it moves through the detect pipeline
+struct DetectJob{
+	bam1_t *record = nullptr;				//alignment record, until the read takes ownership of it
+	std::unique_ptr<DNAscent::read> r;
+	bool failed = false;					//failed QC - skipped by the remaining compute stages
+	double startTime = 0.;					//when the record entered the pipeline, for --profile
+	size_t readLength = 0;
+	uint64_t inputIndex = 0;				//position of the record in the input, for checkpoints
+	int64_t nextInputOffset = -1;				//bgzf virtual offset of the record after this one, -1 if not known
 	
-		r.writeModBamTag();
+	DetectJob() = default;
+	DetectJob(DetectJob &&other){
+
+		*this = std::move(other);
 	}
+	DetectJob &operator=(DetectJob &&other){
+
+		if (record) bam_destroy1(record);
+		record = other.record;
+		other.record = nullptr;
+		r = std::move(other.r);
+		failed = other.failed;
+		startTime = other.startTime;
+		readLength = other.readLength;
+		inputIndex = other.inputIndex;
+		nextInputOffset = other.nextInputOffset;
+		return *this;
+	}
+	~DetectJob(){
+
+		if (record) bam_destroy1(record);
+	}
+};
+
+//how far a detect run got - the results for the first `records` input records are in the first `outputOffset` bytes of the output
+struct DetectCheckpoint{
+	std::string bamFilename;
+	std::string outputFilename;
+	std::string selection;				//regions and shard, which change the order records are read in
+	uint64_t records = 0;
+	int64_t inputOffset = -1;			//bgzf virtual offset of the next input record, or -1 if the input can't be seeked
+	int64_t outputOffset = 0;
+	int written = 0;
+	int failed = 0;
+};
+
+
+static std::string checkpointSelection(Arguments_detect &args){
+
+	std::string selection = args.regionsFilename;
+	for (auto &region : args.regions) selection += ";" + region;
+	if (args.shardByRegion) selection += ";" + std::to_string(args.regionShard) + "/" + std::to_string(args.numRegionShards);
+	if (args.numReadShards > 1) selection += ";reads " + std::to_string(args.readShard) + "/" + std::to_string(args.numReadShards);
+	return selection;
 }
 
-int checkSuffix(const std::string& filename) {
-    if (filename.size() >= 10 && filename.compare(filename.size() - 10, 10, ".blow5.idx") == 0) {
-        return 1;
-    } else if (filename.size() >= 10 && filename.compare(filename.size() - 10, 10, ".slow5.idx") == 0) {
-        return 1;
-    } else {
-        return 0;
-    }
+
+static void writeCheckpoint(std::string filename, DetectCheckpoint &cp){
+
+	//write to a temporary file and rename it over the old checkpoint so a kill mid-write never leaves a partial manifest
+	std::string tmpFilename = filename + ".tmp";
+	std::ofstream out(tmpFilename);
+	if (not out.is_open()) throw IOerror(tmpFilename);
+
+	out << "#DNAscent detect checkpoint" << std::endl;
+	out << "bam " << cp.bamFilename << std::endl;
+	out << "output " << cp.outputFilename << std::endl;
+	out << "selection " << cp.selection << std::endl;
+	out << "records " << cp.records << std::endl;
+	out << "inputOffset " << cp.inputOffset << std::endl;
+	out << "outputOffset " << cp.outputOffset << std::endl;
+	out << "written " << cp.written << std::endl;
+	out << "failed " << cp.failed << std::endl;
+	out.close();
+	if (out.fail()) throw IOerror(tmpFilename);
+
+	if (rename(tmpFilename.c_str(), filename.c_str()) != 0) throw IOerror(filename);
+}
+
+
+static bool readCheckpoint(std::string filename, DetectCheckpoint &cp){
+
+	std::ifstream in(filename);
+	if (not in.is_open()) return false;
+
+	std::string line;
+	while (std::getline(in, line)){
+
+		if (line.empty() or line[0] == '#') continue;
+		size_t split = line.find(' ');
+		std::string key = line.substr(0, split);
+		std::string value = (split == std::string::npos) ? "" : line.substr(split + 1);
+
+		if (key == "bam") cp.bamFilename = value;
+		else if (key == "output") cp.outputFilename = value;
+		else if (key == "selection") cp.selection = value;
+		else if (key == "records") cp.records = std::stoull(value);
+		else if (key == "inputOffset") cp.inputOffset = std::stoll(value);
+		else if (key == "outputOffset") cp.outputOffset = std::stoll(value);
+		else if (key == "written") cp.written = std::stoi(value);
+		else if (key == "failed") cp.failed = std::stoi(value);
+	}
+	return true;
+}
+
+
+static std::unordered_set< std::string > collectFetchIDs( Arguments_detect &args, const std::vector< GenomicRegion > &regions, const std::vector< size_t > &regionsToRun, hts_idx_t *bam_idx, ReadFilter &readFilter ){
+/*reads through the records that detect will run on - the same regions, filters, and shard - and returns the readIDs their
+ *signal is fetched from, so a text index only needs to hold those reads */
+
+	std::unordered_set< std::string > fetchIDs;
+	htsFile *bam_fh = openAlignmentFile(args.bamFilename, "r", NULL, args.referenceFilename);
+	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
+	if (bam_hdr == NULL) throw IOerror(args.bamFilename);
+	bam1_t *record = bam_init1();
+
+	auto collect = [&](bam1_t *r){
+		if ( readFilter.pass(r) and inShard(r, args.readShard, args.numReadShards) ) fetchIDs.insert(getFetchID(r));
+	};
+
+	if (bam_idx != NULL){
+
+		for (auto k : regionsToRun){
+
+			hts_itr_t *itr = sam_itr_queryi(bam_idx, regions[k].tid, regions[k].beg, regions[k].end);
+			if (itr == NULL) throw InvalidRegion(sam_hdr_tid2name(bam_hdr, regions[k].tid));
+			while (sam_itr_next(bam_fh, itr, record) >= 0) collect(record);
+			hts_itr_destroy(itr);
+		}
+	}
+	else{
+		while (sam_read1(bam_fh, bam_hdr, record) >= 0) collect(record);
+	}
+
+	bam_destroy1(record);
+	bam_hdr_destroy(bam_hdr);
+	hts_close(bam_fh);
+	return fetchIDs;
 }
 
+
 int detect_main( int argc, char** argv ){
 
 	Arguments_detect args = parseDetectArguments_detect( argc, argv );
+	if (not args.profileFilename.empty()) profile_enable();
 
     std::cerr << "humanReadable: " << std::boolalpha << args.humanReadable << "\n";
     std::cerr << "useGPU: " << args.useGPU << "\n";
@@ -728,35 +1157,31 @@ int detect_main( int argc, char** argv ){
     std::cerr << "minL: " << args.minL << "\n";
     std::cerr << "threads: " << args.threads << "\n";
 	
-	int flag_slow5 = checkSuffix(args.indexFilename);
-	slow5_file_t *sp = NULL;
+	//the index argument is either a DNAscent index or one or more slow5/blow5 files
+	std::vector< std::string > slow5Filenames = slow5_fileList(args.indexFilename);
+	int flag_slow5 = slow5Filenames.empty() ? 0 : 1;
 	
 	//load DNAscent index
-	std::map< std::string, IndexEntry > readID2path;
+	SignalIndex readIndex;
+	bool indexFromBam = false;
 	if(flag_slow5==0){
-		pod5_init();
-		parseIndex( args.indexFilename, readID2path );
-	}else{
-		slow5_print_version();
-
-		std::string slow5_file_path = args.indexFilename.substr(0, args.indexFilename.size() - 4);
-		//open the SLOW5 file
-		sp = slow5_open(slow5_file_path.c_str(),"r");
-		if(sp==NULL){
-			fprintf(stderr,"Error in opening file\n");
-			exit(EXIT_FAILURE);
-		}
-
-		int ret=0; //for return value
 
-		//load the SLOW5 index (will be built if not present)
-		ret = slow5_idx_load(sp);
-		if(ret<0){
-			fprintf(stderr,"Error in loading index\n");
-			exit(EXIT_FAILURE);
-		}
+		//fork the fast5 decode workers while this is the only thread, and before they'd inherit a copy of the index
+		fast5_setCacheCapacity(args.fast5CacheFiles);
+		if (args.fast5Workers > 0) fast5_startDecodeWorkers(args.fast5Workers);
 
+		pod5_init();
+		pod5_setCacheCapacity(args.pod5CacheFiles, args.pod5CacheBatches);
 
+		//a text index is cut down to the reads in the bam once the regions and filters are known, below - a binary
+		//index is only read where it's looked up, so there's nothing to gain from reading the bam twice
+		indexFromBam = args.indexFromBam and not SignalIndex::isBinaryFile(args.indexFilename);
+		if (not indexFromBam) parseIndex( args.indexFilename, readIndex );
+	}else{
+		slow5_print_version();
+		//blow5 files are already read through the page cache, so reading them in order just needs the kernel to read ahead
+		if (args.sequential and args.slow5Access == Slow5Access::Random) args.slow5Access = Slow5Access::Sequential;
+		slow5_openFiles(slow5Filenames, args.slow5Access);
 	}
 
 	//get the neural network model path
@@ -768,9 +1193,15 @@ int detect_main( int argc, char** argv ){
 
 	std::pair< std::shared_ptr<ModelSession>, std::shared_ptr<TF_Graph *> > modelPair;
 
+	//-t is one budget shared by the compute stages - on CPU, a quarter of it goes to the CNN (whose workers mostly wait on
+	//TensorFlow's own pool, sized to match) and the rest to normalisation and event alignment
+	//on GPU, the CNN workers only wait on the device, so event alignment gets all of -t
+	unsigned int cnnThreads = args.useGPU ? 2 : std::max(1u, args.threads / 4);
+	unsigned int alignThreads = args.useGPU ? args.threads : std::max(1u, args.threads - cnnThreads);
+
 	if (not args.useGPU){
 
-		modelPair = model_load_cpu_twoInputs(modelPath.c_str(), args.threads);
+		modelPair = model_load_cpu_twoInputs(modelPath.c_str(), 2*cnnThreads);
 	}
 	else{
 
@@ -793,19 +1224,48 @@ int detect_main( int argc, char** argv ){
 	//import fasta reference
 	std::map< std::string, std::string > reference = import_reference_pfasta( args.referenceFilename );
 
+	//shared by the input bam and the output bam/cram - declared before both so that it outlives them
+	HtsIOPool ioPool(args.ioThreads);
+
 	//load the bam
 	std::cout << "Opening bam file... ";
-	htsFile *bam_fh_cr = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh_cr == NULL) throw IOerror(args.bamFilename);
-	bam_hdr_t *bam_hdr_cr = sam_hdr_read(bam_fh_cr);
+	htsFile *bam_fh = openAlignmentFile(args.bamFilename, "r", &ioPool, args.referenceFilename);
+	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
 	std::cout << "ok." << std::endl;
 
+	//the checkpoint manifest sits next to the output
+	std::string checkpointFilename = args.outputFilename + ".ckpt";
+	DetectCheckpoint resumeFrom;
+	bool resuming = false;
+	if (args.resume){
+
+		if (args.cram) throw CheckpointUnsupported("cram output");
+
+		resuming = readCheckpoint(checkpointFilename, resumeFrom);
+		if (resuming){
+
+			if (resumeFrom.bamFilename != args.bamFilename or resumeFrom.outputFilename != args.outputFilename or resumeFrom.selection != checkpointSelection(args)) throw CheckpointMismatch(checkpointFilename);
+
+			//cut the output back to the checkpoint - anything after it may be a partly written read
+			if (truncate(args.outputFilename.c_str(), resumeFrom.outputOffset) != 0) throw IOerror(args.outputFilename);
+			std::cout << "Resuming after " << resumeFrom.records << " bam records from checkpoint." << std::endl;
+		}
+		else std::cout << "No checkpoint found, starting from the beginning." << std::endl;
+	}
+	else{
+
+		//a checkpoint left by an earlier run describes an output we're about to overwrite
+		std::remove(checkpointFilename.c_str());
+	}
+
 	//make the output writer
 	OutputFormat format;
 	if (args.humanReadable) format = OutputFormat::HumanReadable;
+	else if (args.cram) format = OutputFormat::Cram;
 	else format = OutputFormat::Sam;
-	auto writer = OutputWriterFactory::createWriter(format);
-	writer -> open(args.outputFilename);
+	auto writer = OutputWriterFactory::createWriter(format, args.referenceFilename, &ioPool);
+	if (resuming) writer -> openAppend(args.outputFilename);
+	else writer -> open(args.outputFilename);
 
 	//write the output header
 	if (args.humanReadable){
@@ -813,128 +1273,295 @@ int detect_main( int argc, char** argv ){
 		writer -> writeHeader_HR(outHeader);
 	}
 	else{
-		writer -> writeHeader_sam(bam_hdr_cr);
+		writer -> writeHeader_sam(bam_hdr);
 	}
 
-	//initialise progress
-	int numOfRecords = 0, prog = 0, failed = 0;
-	countRecords( bam_fh_cr, bam_hdr_cr, numOfRecords, args.minQ, args.minL );
-	progressBar pb(numOfRecords,true);
-	bam_hdr_destroy(bam_hdr_cr);
-	hts_close(bam_fh_cr);
+	//resolve the regions to run on, if any - sharding on its own splits the work by reference
+	bool regionQuery = args.regions.size() > 0 or not args.regionsFilename.empty() or args.shardByRegion;
+	std::vector< GenomicRegion > regions;
+	std::vector< size_t > regionsToRun;
+	hts_idx_t *bam_idx = NULL;
+	hts_pos_t regionBases = 0;
+	if (regionQuery){
 
-	int failedEvents = 0;
-	unsigned int maxBufferSize;
-	std::vector< bam1_t * > buffer;
-	maxBufferSize = 16*(args.threads);
+		bam_idx = sam_index_load(bam_fh, args.bamFilename.c_str());
+		if (bam_idx == NULL) throw MissingBamIndex(args.bamFilename);
 
-	htsFile *bam_fh = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh == NULL) throw IOerror(args.bamFilename);
-	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
-	bam1_t *itr_record = bam_init1();
-	int result = sam_read1(bam_fh, bam_hdr, itr_record);
+		if (args.regions.size() > 0 or not args.regionsFilename.empty()){
+			regions = parseRegions(bam_hdr, args.regions, args.regionsFilename);
+		}
+		else{
+			for (int tid = 0; tid < bam_hdr -> n_targets; tid++) regions.push_back({tid, 0, (hts_pos_t) bam_hdr -> target_len[tid]});
+		}
+		regionsToRun = shardRegions(regions, args.regionShard, args.numRegionShards);
+		for (auto k : regionsToRun) regionBases += regions[k].end - regions[k].beg;
+	}
 
-	while(result >= 0){
-	
-		bam1_t *record = bam_dup1(itr_record);
+	//initialise progress - estimated from the bam as it's read so that the bam is only decoded once
+	std::unique_ptr<BamProgress> bamProgress;
+	if (regionQuery) bamProgress.reset(new BamProgress(regionBases));
+	else bamProgress.reset(new BamProgress(bam_fh, bam_hdr, args.bamFilename));
+	progressBar pb(true);
+
+	//each stage has its own pool of persistent workers fed by a bounded queue, so the bam reader, signal I/O, 
+	//and compute all run at the same time and a long read only occupies the worker that is processing it
+	std::atomic<int> failed(resumeFrom.failed);
+	int prog = resumeFrom.written, failedEvents = 0;
+
+	DetectCheckpoint committed = resumeFrom;
+	committed.bamFilename = args.bamFilename;
+	committed.outputFilename = args.outputFilename;
+	committed.selection = checkpointSelection(args);
+	auto lastCheckpoint = std::chrono::steady_clock::now();
+	//declared before the pipeline so that it outlives the signal workers that wait on it
+	std::unique_ptr< Pod5SequentialReader > sequentialReader;
+	if (args.sequential and flag_slow5 == 0) sequentialReader.reset(new Pod5SequentialReader());
+
+	Pipeline<DetectJob> pipeline(2*args.threads);
+
+	//reads are written in the same order as the input bam, so sorted input gives sorted output - the in-flight limit
+	//is generous enough to keep every stage busy but stops the reorder buffer growing without bound behind one slow read
+	pipeline.setOrderedOutput(16*args.threads + args.cnnBatch + args.prefetchReads);
+
+	//reads waiting for signal are fetched together so that reads from the same pod5 file share the open file and
+	//decoded batches, and split reads with the same parent only decode the parent's signal once
+	//signal is fetched on its own threads so that the compute threads don't wait on file reads
+	pipeline.addBatchStage("signal", args.prefetchThreads, maxReadsPerSignalFetch, [&](std::vector<DetectJob> &jobs){
+
+		for (auto &job : jobs){
+			job.r.reset(new DNAscent::read(job.record, bam_hdr, readIndex, reference, flag_slow5));
+			job.record = nullptr; //now owned by the read
+		}
+
+		ProfileTimer timer(ProfileStage::SignalIO);
+		std::vector< DNAscent::read * > pod5Reads, fast5Reads;
+		for (auto &job : jobs){
+
+			const char *ext = get_ext(job.r -> filename.c_str());
 
-		//add the record to the buffer if it passes the user's criteria, otherwise destroy it cleanly
-		int mappingQual = record -> core.qual;
-		int refStart,refEnd;
-		getRefEnd(record,refStart,refEnd);
-		int queryLen = record -> core.l_qseq;
+			if(flag_slow5 == 1){
 
-		if ( mappingQual >= args.minQ and refEnd - refStart >= args.minL and queryLen != 0 ){
+				//a read missing from the slow5 files fails on its own rather than stopping the run
+				if (not slow5_getSignal(*job.r)){
+					job.failed = true;
+					failed++;
+				}
+			}
+			else if (strcmp(ext,"pod5") == 0){
 
-			buffer.push_back(record);
+				//reads the sequential reader has already passed are fetched with the rest
+				if (not (sequentialReader and sequentialReader -> take(*job.r))) pod5Reads.push_back(job.r.get());
+			}
+			else if (strcmp(ext,"fast5") == 0){
+				fast5Reads.push_back(job.r.get());
+			} 
 		}
-		else{
-			bam_destroy1(record);
+		for (auto &sameFile : sortReadsByFilename(pod5Reads)) pod5_getSignal_batch(sameFile);
+
+		//reads in the same multi-read fast5 are all served by one open of the file
+		for (auto &sameFile : sortReadsByFilename(fast5Reads)) fast5_getSignal_batch(sameFile);
+		timer.stop();
+
+		//raw signal is stored as 16-bit samples in all three formats
+		for (auto &job : jobs) profile_addBytes(ProfileBytes::Signal, job.r -> raw.size() * sizeof(int16_t));
+	});
+
+	//normalisation and event alignment run back to back on the same worker, so together they only take alignThreads
+	pipeline.addStage("eventalign", alignThreads, [&](DetectJob &job){
+
+		if (job.failed) return;
+
+		//for HMM
+		//bool useFitPoreModel = true;
+		//normaliseEvents(r, useFitPoreModel);
+
+		//for DNN
+		bool useFitPoreModel = false;
+		{
+			ProfileTimer timer(ProfileStage::Normalisation);
+			normaliseEvents( *job.r, useFitPoreModel);
+		}
+
+		//catch reads with rough event alignments that fail the QC
+		if ( job.r -> eventAlignment.size() == 0 ){
+			job.failed = true;
+			failed++;
+			return;
+		}
+
+		//HMMdetection hmm_likelihood = llAcrossRead(r, 12);
+		//readOut = hmm_likelihood.stdout;
+
+		try {
+			ProfileTimer timer(ProfileStage::EventAlignment);
+			eventalign( *job.r, Pore_Substrate_Config.windowLength_align);
+		} catch (const std::exception& e) {
+			std::cerr << job.r -> readID << ": " << e.what() << std::endl;
+			job.r -> QCpassed = false;
+		}
+
+		if (not job.r -> QCpassed){
+			job.failed = true;
+			failed++;
+		}
+	});
+
+	//reads with signal wait in front of the compute stages, so the signal threads run this far ahead of them
+	pipeline.setInputLimit(args.prefetchReads, (size_t) args.prefetchMB << 20, [](const DetectJob &job){
+		return job.r ? job.r -> raw.size() * sizeof(int16_t) : (size_t) 0;
+	});
+
+	//reads waiting for the CNN are run together, bucketed by length, so the per-call overhead is shared across reads
+	pipeline.addBatchStage("CNN", cnnThreads, args.cnnBatch, [&](std::vector<DetectJob> &jobs){
+
+		std::vector<DNAscent::read *> reads;
+		for (auto &job : jobs){
+			if (not job.failed) reads.push_back(job.r.get());
 		}
+		if (reads.size() > 0) runCNN_batch(reads,session,inputOps,args.humanReadable);
+	});
+
+	//one writer thread so that disk writes and bgzf compression stay off the compute workers
+	pipeline.addStage("writer", 1, [&](DetectJob &job){
+
+		{
+			ProfileTimer timer(ProfileStage::Write);
+			if (not job.failed) writer -> write(*job.r);
+		}
+		job.r.reset();
+		if (profilingEnabled) profile_recordReadLatency(job.readLength, profile_wallNow() - job.startTime);
+
+		prog++;
+
+		//output is in input order, so once this read is written every input record up to it is done
+		committed.records = job.inputIndex + 1;
+		committed.inputOffset = job.nextInputOffset;
+		committed.written = prog;
+		if (job.failed) committed.failed++;
+		if (args.checkpointInterval > 0 and std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(args.checkpointInterval)){
+
+			committed.outputOffset = writer -> checkpoint();
+			if (committed.outputOffset >= 0) writeCheckpoint(checkpointFilename, committed);
+			lastCheckpoint = std::chrono::steady_clock::now();
+		}
+		pb.displayProgress( bamProgress -> fraction(), prog, failed, failedEvents );
+	});
+
+	//records that can't pass are dropped on the reader thread before they're copied
+	ReadFilter readFilter(args.minQ, args.minL, args.excludeFlags);
+	if (not args.readIDsFilename.empty()) readFilter.allowReadIDs(args.readIDsFilename);
+	if (not args.excludeReadIDsFilename.empty()) readFilter.denyReadIDs(args.excludeReadIDsFilename);
+
+	if (indexFromBam){
+
+		std::cout << "Finding reads in the bam... ";
+		std::unordered_set< std::string > fetchIDs = collectFetchIDs(args, regions, regionsToRun, bam_idx, readFilter);
+		std::cout << fetchIDs.size() << " reads." << std::endl;
+		parseIndex( args.indexFilename, readIndex, &fetchIDs );
+	}
+
+	pipeline.start();
+
+	//add the record to the pipeline if it passes the user's criteria - returns false if the pipeline has stopped
+	auto addRecord = [&](bam1_t *record, uint64_t inputIndex, int64_t nextInputOffset){
 
-		result = sam_read1(bam_fh, bam_hdr, itr_record);
+		profile_addBytes(ProfileBytes::Bam, record -> l_data);
 
-		//if we've filled up the buffer with reads, compute them in parallel
-		if (buffer.size() >= maxBufferSize or (buffer.size() > 0 and result == -1 ) ){
+		if ( readFilter.pass(record) and inShard(record, args.readShard, args.numReadShards) ){
 
-			for(unsigned int i = 0; i < buffer.size(); i++){
-				fprintf(stderr, "%s\n", bam_get_qname(buffer[i]));
+			//let the sequential reader know this read is coming so it can pick up its signal on the way past
+			if (sequentialReader){
+				std::string fetchID = getFetchID(record);
+				IndexEntry ie;
+				if (readIndex.find(fetchID, ie) and strcmp(get_ext(ie.filepath.c_str()),"pod5") == 0) sequentialReader -> want(fetchID, ie);
 			}
 
-			#pragma omp parallel for schedule(dynamic) shared(buffer,Pore_Substrate_Config,args,prog,failed,session,inputOps,writer) num_threads(args.threads)
-			for (unsigned int i = 0; i < buffer.size(); i++){
-				DNAscent::read r(buffer[i], bam_hdr, readID2path, reference,flag_slow5);
+			DetectJob job;
+			job.record = bam_dup1(record);
+			job.readLength = record -> core.l_qseq;
+			job.inputIndex = inputIndex;
+			job.nextInputOffset = nextInputOffset;
+			if (profilingEnabled) job.startTime = profile_wallNow();
+			return pipeline.push(std::move(job));
+		}
+		return true;
+	};
 
-				const char *ext = get_ext(r.filename.c_str());
+	//when resuming, jump straight to the first record after the checkpoint if the bam can be seeked, otherwise skip records up to it
+	uint64_t inputIndex = 0, skipUntil = 0;
+	if (resuming){
 
-				if (strcmp(ext,"pod5") == 0){
-					pod5_getSignal(r);
-				}
-				else if (strcmp(ext,"fast5") == 0){
-					fast5_getSignal(r);
-				} 
-				else if(flag_slow5 == 1){
-					slow5_getSignal(r,sp);
-				}
-				// fprintf(stderr,"%s,%f,%f,%f\n",r.readID.c_str(),r.raw[0],r.raw[1],r.raw[2]);
-				//for HMM
-				//bool useFitPoreModel = true;
-				//normaliseEvents(r, useFitPoreModel);
+		if (not regionQuery and resumeFrom.inputOffset >= 0 and bam_fh -> is_bgzf and bgzf_seek(bam_fh -> fp.bgzf, resumeFrom.inputOffset, SEEK_SET) == 0){
+			inputIndex = resumeFrom.records;
+			bamProgress -> skipRecords(resumeFrom.records);
+		}
+		else skipUntil = resumeFrom.records;
+	}
 
-				//for DNN
-				bool useFitPoreModel = false;
-				normaliseEvents( r, useFitPoreModel);
+	//bam decode runs on this thread and only stalls when the signal stage is backed up
+	bam1_t *itr_record = bam_init1();
+	if (regionQuery){
 
-				//catch reads with rough event alignments that fail the QC
-				if ( r.eventAlignment.size() == 0 ){
-					failed++;
-					prog++;
-					continue;
-				}
+		hts_pos_t basesDone = 0;
+		for (auto k : regionsToRun){
 
-				//HMMdetection hmm_likelihood = llAcrossRead(r, 12);
-				//readOut = hmm_likelihood.stdout;
-				
-				try {
-					eventalign( r, Pore_Substrate_Config.windowLength_align);
-				} catch (const std::exception& e) {
-					std::cerr << r.readID << ": " << e.what() << std::endl;
-					r.QCpassed = false;
-				}
+			GenomicRegion &region = regions[k];
+			hts_itr_t *itr = sam_itr_queryi(bam_idx, region.tid, region.beg, region.end);
+			if (itr == NULL) throw InvalidRegion(sam_hdr_tid2name(bam_hdr, region.tid));
 
-				if (not r.QCpassed){
-					failed++;
-					prog++;
-					continue;
-				}
+			bool running = true;
+			while (running and sam_itr_next(bam_fh, itr, itr_record) >= 0){
 
-				runCNN(r,session,inputOps,args.humanReadable);
+				uint64_t thisIndex = inputIndex++;
+				if (thisIndex < skipUntil) continue;
 
-				prog++;
-				// pb.displayProgress( prog, failed, failedEvents );
-				
-				#pragma omp critical
-				{
-					writer -> write(r);
-					// pb.displayProgress( prog, failed, failedEvents );
-				}
+				//regions are merged and sorted, so a record that overlaps the region before this one was picked up there
+				if (k > 0 and regions[k-1].tid == region.tid and itr_record -> core.pos < regions[k-1].end) continue;
+
+				bamProgress -> updateBases(basesDone + std::max(itr_record -> core.pos - region.beg, (hts_pos_t) 0));
+				running = addRecord(itr_record, thisIndex, -1);
 			}
-			buffer.clear();
-			fprintf(stderr, "*\n");
-			pb.displayProgress( prog, failed, failedEvents );
+			hts_itr_destroy(itr);
+			if (not running) break;
+			basesDone += region.end - region.beg;
+		}
+	}
+	else{
+
+		while(sam_read1(bam_fh, bam_hdr, itr_record) >= 0){
+
+			bamProgress -> update();
+
+			uint64_t thisIndex = inputIndex++;
+			if (thisIndex < skipUntil) continue;
+
+			int64_t nextInputOffset = bam_fh -> is_bgzf ? (int64_t) bgzf_tell(bam_fh -> fp.bgzf) : -1;
+			if (not addRecord(itr_record, thisIndex, nextInputOffset)) break;
 		}
 	}
+	if (sequentialReader) sequentialReader -> finish();
+	pipeline.finish();
+
 	bam_destroy1(itr_record);
+	if (bam_idx != NULL) hts_idx_destroy(bam_idx);
 	bam_hdr_destroy(bam_hdr);
 	hts_close(bam_fh);
 	writer -> close();
 	std::cout << std::endl;
 
+	//the output is complete, so there's nothing to resume from
+	std::remove(checkpointFilename.c_str());
+
+	//every worker has finished, so the per-thread counters can be merged
+	profile_write(args.profileFilename, args.threads);
+
 	if(flag_slow5==0){
+		pod5_closeCachedFiles();
 		pod5_terminate();
+		fast5_closeCachedFiles();
+		fast5_stopDecodeWorkers();
 	}else{
-		slow5_idx_unload(sp);
-		slow5_close(sp);
+		slow5_closeFiles();
 	}
 	return 0;
 }
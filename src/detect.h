@@ -15,8 +15,11 @@
 #include "reads.h"
 #include "tensor.h"
 #include "error_handling.h"
+#include "htsInterface.h"
 #include "../htslib/htslib/hts.h"
 #include "../htslib/htslib/sam.h"
+#include "../htslib/htslib/bgzf.h"
+#include "../htslib/htslib/hfile.h"
 
 struct HMMdetection{
 
@@ -30,8 +33,10 @@ class OutputWriter {
 	public:
 		virtual ~OutputWriter() {}
 		virtual void open(const std::string& filename) = 0;
+		virtual void openAppend(const std::string& filename) = 0;	//reopen output that was cut back to a checkpoint and write after it (no header)
 		virtual void write(const DNAscent::read &r) = 0;
 		virtual void close() = 0;
+		virtual int64_t checkpoint() = 0;				//flush to disk and return the length of valid output, or -1 if the format can't be resumed
 		virtual void writeHeader_HR(const std::string& header_str) = 0;
 		virtual void writeHeader_sam(bam_hdr_t *sam_hdr) = 0;		
 };
@@ -41,12 +46,18 @@ class HumanReadableWriter : public OutputWriter {
 
 	private:
 		std::ofstream file;
+		bool appending = false;
 		
 	public:
 		void open(const std::string& filename) override {
 			file.open(filename);
 			if (not file.is_open()) throw IOerror(filename);
 		}
+		void openAppend(const std::string& filename) override {
+			file.open(filename, std::ios::app);
+			if (not file.is_open()) throw IOerror(filename);
+			appending = true;
+		}
 
 		void write(const DNAscent::read &r) override {
 			if (file.is_open()) {
@@ -59,8 +70,13 @@ class HumanReadableWriter : public OutputWriter {
 				file.close();
 			}
 		}
+		int64_t checkpoint() override {
+			file.flush();
+			if (not file.good()) throw IOerror("output file could not be flushed for checkpoint");
+			return file.tellp();
+		}
 		void writeHeader_HR(const std::string& header_str){
-			if (file.is_open()) {
+			if (file.is_open() and not appending) {
 				file << header_str;
 			}
 		}
@@ -71,16 +87,32 @@ class HumanReadableWriter : public OutputWriter {
 class SamWriter : public OutputWriter {
 
 	private:
-		htsFile *file;
+		htsFile *file = nullptr;
 		bam_hdr_t *header;
 		std::string fn;
+		std::string mode;
+		std::string referenceFilename;
+		HtsIOPool *ioPool;
+		bool cram;
+		bool appending = false;
 
 	public:
+		SamWriter(bool cram, std::string referenceFilename, HtsIOPool *ioPool){
+			this -> cram = cram;
+			mode = cram ? "wc" : "wb";
+			this -> referenceFilename = referenceFilename;
+			this -> ioPool = ioPool;
+		}
 		void open(const std::string& filename) override {
-			file = sam_open(filename.c_str(), "wb");
-			if (file == nullptr) throw IOerror(filename);
+			file = openAlignmentFile(filename, mode, ioPool, referenceFilename);
 			fn = filename;
 		}
+		void openAppend(const std::string& filename) override {
+			if (cram) throw CheckpointUnsupported("cram output");
+			file = openAlignmentFile(filename, "ab", ioPool, referenceFilename);
+			fn = filename;
+			appending = true;
+		}
 
 		void write(const DNAscent::read &r) override {
 			if (file){
@@ -92,12 +124,21 @@ class SamWriter : public OutputWriter {
 		void close() override {
 			if (file){
 				sam_close(file);
+				file = nullptr;
 			}
 		}
+		int64_t checkpoint() override {
+			//cram containers can't be cut and appended to, so cram runs can't be resumed
+			if (cram or not file) return -1;
+
+			//finish the current bgzf block so the file up to here is a valid (if unterminated) bam
+			if (bgzf_flush(file -> fp.bgzf) < 0 or hflush(file -> fp.bgzf -> fp) < 0) throw BamWriteError(fn);
+			return htell(file -> fp.bgzf -> fp);
+		}
 		void writeHeader_HR(const std::string& header_str){ }
 		void writeHeader_sam(bam_hdr_t *sam_hdr){
 			header = sam_hdr;
-			if (file) {
+			if (file and not appending) {
 				int status = sam_hdr_write(file, sam_hdr);
 				if (status < 0) throw BamWriteError(fn);
 			}
@@ -105,16 +146,18 @@ class SamWriter : public OutputWriter {
 };
 
 
-enum class OutputFormat { HumanReadable, Sam };
+enum class OutputFormat { HumanReadable, Sam, Cram };
 
 class OutputWriterFactory {
 	public:
-		static std::unique_ptr<OutputWriter> createWriter(OutputFormat format) {
+		static std::unique_ptr<OutputWriter> createWriter(OutputFormat format, std::string referenceFilename = "", HtsIOPool *ioPool = nullptr) {
 			switch (format) {
 				case OutputFormat::HumanReadable:
 					return std::make_unique<HumanReadableWriter>();
 				case OutputFormat::Sam:
-					return std::make_unique<SamWriter>();
+					return std::make_unique<SamWriter>(false, referenceFilename, ioPool);
+				case OutputFormat::Cram:
+					return std::make_unique<SamWriter>(true, referenceFilename, ioPool);
 				default:
 					return nullptr;
 			}
@@ -126,6 +169,7 @@ int detect_main( int argc, char** argv );
 std::vector< unsigned int > getPOIs( std::string &, int );
 double sequenceProbability( std::vector <double> &, std::string &, size_t, bool, PoreParameters, size_t, size_t );
 void runCNN(DNAscent::read & , std::shared_ptr<ModelSession> , std::vector<TF_Output>, bool );
+void runCNN_batch(std::vector<DNAscent::read *> &, std::shared_ptr<ModelSession> , std::vector<TF_Output>, bool );
 HMMdetection llAcrossRead( DNAscent::read &, unsigned int );
 
 #endif
@@ -188,6 +188,101 @@ struct TrailingFlag : public std::exception {
 };
 
 
+struct InvalidRegion : public std::exception {
+	std::string badRegion;
+	InvalidRegion( std::string s ){
+
+		badRegion = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Region could not be parsed or is not a reference in the bam header: ";
+		const char* specifier = badRegion.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
+struct MissingBamIndex : public std::exception {
+	std::string bamFilename;
+	MissingBamIndex( std::string s ){
+
+		bamFilename = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Region queries need an indexed bam (run samtools index) - no index found for: ";
+		const char* specifier = bamFilename.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
+struct InvalidShard : public std::exception {
+	std::string badShard;
+	InvalidShard( std::string s ){
+
+		badShard = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Shard should be given as i/N with 0 <= i < N: ";
+		const char* specifier = badShard.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
+struct CheckpointUnsupported : public std::exception {
+	std::string reason;
+	CheckpointUnsupported( std::string s ){
+
+		reason = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Checkpoint and resume are not supported for: ";
+		const char* specifier = reason.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
+struct CheckpointMismatch : public std::exception {
+	std::string checkpointFilename;
+	CheckpointMismatch( std::string s ){
+
+		checkpointFilename = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Checkpoint does not match this run (different input bam, output, or options) - remove it or rerun without --resume: ";
+		const char* specifier = checkpointFilename.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
 struct InsufficientArguments : public std::exception {
 	const char * what () const throw () {
 		return "Insufficient number of arguments passed to executable.";
@@ -286,5 +381,37 @@ struct InvalidLengthThreshold : public std::exception {
 	}
 };
 
+struct InvalidBatchSize : public std::exception {
+	const char * what () const throw () {
+		return "Batch size passed with --cnn-batch must be an integer >= 1.";
+	}
+};
+
+struct MergeHeaderMismatch : public std::exception {
+	std::string filename;
+	MergeHeaderMismatch( std::string s ){
+
+		filename = s;
+	}
+	const char* what () const throw () {
+		const char* message = "Header does not match the first file being merged (different references or detect options): ";
+		const char* specifier = filename.c_str();
+		char* result;
+		result = static_cast<char*>(calloc(strlen(message)+strlen(specifier)+1, sizeof(char)));
+		strcpy( result, message);
+		strcat( result, specifier );
+
+		return result;
+	}
+};
+
+
+struct MergeFormatMismatch : public std::exception {
+	const char* what () const throw () {
+		return "Files to merge and the output must all be .detect, or all be .bam/.cram.";
+	}
+};
+
+
 #endif
 
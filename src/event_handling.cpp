@@ -18,6 +18,7 @@
 #include "event_handling.h"
 #include "common.h"
 #include "config.h"
+#include "profile.h"
 #include <chrono>
 
 
@@ -543,7 +544,11 @@ PoreParameters estimateScaling_quantiles(std::vector< double > &signal_means, st
 
 void normaliseEvents( DNAscent::read &r, bool useFitPoreModel ){
 
-	event_table et = detect_events(&(r.raw)[0], (r.raw).size(), event_detection_defaults);
+	event_table et;
+	{
+		ProfileTimer timer(ProfileStage::EventDetection);
+		et = detect_events_int16(r.raw.data(), r.raw.size(), r.raw.offset(), r.raw.scale(), event_detection_defaults);
+	}
 	assert(et.n > 0);
 	
 	r.events.reserve(et.n);
@@ -560,10 +565,11 @@ void normaliseEvents( DNAscent::read &r, bool useFitPoreModel ){
 				event e;
 				e.mean = mean;
 				event_means.push_back(mean);
-				for (unsigned int j = rawStart; j <= std::min(et.event[i].start-1, r.raw.size()-1); j++){
-				
-					e.raw.push_back(r.raw[j]);
-				}
+
+				//the event points back into the read's samples rather than keeping its own copy of them
+				size_t rawEnd = std::min((size_t) et.event[i].start, r.raw.size());
+				e.rawStart = rawStart;
+				e.rawLength = (rawEnd > rawStart) ? rawEnd - rawStart : 0;
 				r.events.push_back(e);				
 				
 				//save stats for the next event
@@ -592,13 +598,23 @@ void normaliseEvents( DNAscent::read &r, bool useFitPoreModel ){
 	}
 
 	//normalise by quantile scaling by comparing the raw signal against the reference sequence
-	r.scalings = estimateScaling_quantiles( event_means, r.referenceSeqMappedTo, kmer_ranks_ref, useFitPoreModel );
+	{
+		ProfileTimer timer(ProfileStage::ScalingQuantiles);
+		r.scalings = estimateScaling_quantiles( event_means, r.referenceSeqMappedTo, kmer_ranks_ref, useFitPoreModel );
+	}
 
 	// Rough alignment of signals to query sequence
-	std::pair<std::vector<double>, std::vector<unsigned int>> segmentation = adaptive_banded_simple_event_align(r, kmer_ranks_query, kmer_ranks_ref, useFitPoreModel);
+	std::pair<std::vector<double>, std::vector<unsigned int>> segmentation;
+	{
+		ProfileTimer timer(ProfileStage::BandedAlignment);
+		segmentation = adaptive_banded_simple_event_align(r, kmer_ranks_query, kmer_ranks_ref, useFitPoreModel);
+	}
 
 	//fine tune scaling parameters
-	r.scalings = estimateScaling_theilSen(segmentation.first, segmentation.second, r.scalings, useFitPoreModel );
+	{
+		ProfileTimer timer(ProfileStage::ScalingTheilSen);
+		r.scalings = estimateScaling_theilSen(segmentation.first, segmentation.second, r.scalings, useFitPoreModel );
+	}
 	
 	//fail the read if it fails scaling refminement
 	if (r.scalings.shift == -1.) r.eventAlignment.clear();
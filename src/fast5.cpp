@@ -13,6 +13,16 @@
 #include "fast5.h"
 #include <vector>
 #include <string>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #define _USE_MATH_DEFINES
 
@@ -42,28 +52,100 @@ float fast5_read_float_attribute(hid_t group, const char *attribute) {
 //end scrappie
 
 
-void fast5_getSignal( DNAscent::read &r ){
+//ways that decoding a read can fail, so that a decode worker process can report them back
+enum Fast5Status{ Fast5OK = 0, Fast5IOFailure, Fast5BadField, Fast5VBZFailure };
+
+
+//each thread keeps the fast5 files it has recently read from open, so reads from the same file don't reopen it and
+//reparse its metadata under HDF5's global lock - most recently used at the front
+struct Fast5Cache{
+
+	std::list< std::pair< std::string, hid_t > > files;
+
+	void clear( void ){
+
+		for (auto &f : files) H5Fclose(f.second);
+		files.clear();
+	}
+};
+
+static size_t fast5FileCacheCapacity = 4;
+
+//caches outlive the threads that own them so they can all be closed at the end of the run
+static std::mutex fast5CacheRegistryMtx;
+static std::vector< std::unique_ptr< Fast5Cache > > fast5CacheRegistry;
+
+
+static Fast5Cache &localFast5Cache( void ){
+
+	thread_local Fast5Cache *cache = nullptr;
+	if (cache == nullptr){
+
+		std::lock_guard<std::mutex> lock(fast5CacheRegistryMtx);
+		fast5CacheRegistry.emplace_back(new Fast5Cache);
+		cache = fast5CacheRegistry.back().get();
+	}
+	return *cache;
+}
+
+
+void fast5_setCacheCapacity( size_t files ){
+/*number of open files each thread keeps - call before any worker threads start */
 
-	std::string filename = r.filename;
-	std::string readID = r.readID_fetch;
+	fast5FileCacheCapacity = std::max(files, (size_t) 1);
+}
+
+
+void fast5_closeCachedFiles( void ){
+/*closes every thread's cached files - call once the threads that fetch signal have finished */
+
+	std::lock_guard<std::mutex> lock(fast5CacheRegistryMtx);
+	for (auto &c : fast5CacheRegistry) c -> clear();
+}
+
+
+static hid_t cachedFast5File( Fast5Cache &cache, const std::string &filename ){
+/*returns a negative id if the file can't be opened */
+
+	for (auto f = cache.files.begin(); f != cache.files.end(); f++){
+
+		if (f -> first == filename){
+			cache.files.splice(cache.files.begin(), cache.files, f);
+			return f -> second;
+		}
+	}
 
-	//open the file
 	hid_t hdf5_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-	if (hdf5_file < 0) throw IOerror(filename.c_str());
+	if (hdf5_file < 0) return hdf5_file;
 
-	//check for vbz compression and fail if plugin is not loaded
-	bool vbz_compressed = false;
-    unsigned int flags;
+	if (cache.files.size() >= fast5FileCacheCapacity){
+
+		H5Fclose(cache.files.back().second);
+		cache.files.pop_back();
+	}
+	cache.files.emplace_front(filename, hdf5_file);
+	return hdf5_file;
+}
+
+
+static bool fast5_isVBZ( hid_t hdf5_file, const std::string &signal_path ){
+/*whether the signal uses the vbz filter - only asked when a read fails, to say that the plugin isn't loaded */
+
+	unsigned int flags;
 	size_t nelmts = 1;
-    unsigned int values_out[1] = {99};
+	unsigned int values_out[1] = {99};
 	char filter_name[80];
-	std::string signal_path = "/read_" + readID + "/Raw/Signal";
 	hid_t dcheck = H5Dopen(hdf5_file, signal_path.c_str(), H5P_DEFAULT);
-    hid_t dcpl = H5Dget_create_plist(dcheck);
-    H5Z_filter_t filter_id = H5Pget_filter2(dcpl, (unsigned) 0, &flags, &nelmts, values_out, sizeof(filter_name) - 1, filter_name, NULL);
-    H5Pclose (dcpl);
-    H5Dclose (dcheck);
-	if(filter_id == 32020) vbz_compressed = true;
+	if (dcheck < 0) return false;
+	hid_t dcpl = H5Dget_create_plist(dcheck);
+	H5Z_filter_t filter_id = H5Pget_filter2(dcpl, (unsigned) 0, &flags, &nelmts, values_out, sizeof(filter_name) - 1, filter_name, NULL);
+	H5Pclose (dcpl);
+	H5Dclose (dcheck);
+	return filter_id == 32020;
+}
+
+
+static Fast5Status fast5_decode( hid_t hdf5_file, const std::string &readID, RawSignal &signal ){
 
 	//get the channel parameters
 	std::string scaling_path = "/read_" + readID + "/channel_id";
@@ -71,117 +153,304 @@ void fast5_getSignal( DNAscent::read &r ){
 	float digitisation = fast5_read_float_attribute(scaling_group, "digitisation");
 	float offset = fast5_read_float_attribute(scaling_group, "offset");
 	float range = fast5_read_float_attribute(scaling_group, "range");
-	H5Gclose(scaling_group);
+	if (scaling_group >= 0) H5Gclose(scaling_group);
 
-	//get the raw signal
+	//get the raw signal - kept as ADC samples and converted to pA when it's used
 	hid_t space;
 	hsize_t nsample;
-	float raw_unit;
-	float *rawptr = NULL;
 
+	std::string signal_path = "/read_" + readID + "/Raw/Signal";
 	hid_t dset = H5Dopen(hdf5_file, signal_path.c_str(), H5P_DEFAULT);
-	if (dset < 0 ) throw BadFast5Field(); 
+	if (dset < 0 ) return Fast5BadField;
 	space = H5Dget_space(dset);
-	if (space < 0 ) throw BadFast5Field(); 
+	if (space < 0 ){
+		H5Dclose(dset);
+		return Fast5BadField;
+	}
 	H5Sget_simple_extent_dims(space, &nsample, NULL);
-   	rawptr = (float*)calloc(nsample, sizeof(float));
-    herr_t status = H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, rawptr);
+	H5Sclose(space);
+	signal.samples.resize(nsample);
+	herr_t status = H5Dread(dset, H5T_NATIVE_INT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, signal.samples.data());
+	H5Dclose(dset);
+
+	//check for vbz compression and fail if plugin is not loaded
+	if ( status < 0 ) return fast5_isVBZ(hdf5_file, signal_path) ? Fast5VBZFailure : Fast5BadField;
+
+	signal.offset = offset;
+	signal.scale = range / digitisation;
+	return Fast5OK;
+}
+
+
+//fast5 files can be decoded in separate processes, each with its own copy of HDF5 and so its own global lock
+//a signal thread borrows an idle worker, sends it a file and the readIDs to decode from it, and reads back the signals
+struct Fast5Worker{
+	pid_t pid;							//-1 once the worker has been retired
+	int toWorker, fromWorker;
+};
+
+static std::vector< Fast5Worker > fast5Workers;
+static std::vector< size_t > idleFast5Workers;
+static size_t liveFast5Workers = 0;
+static std::mutex fast5WorkerMtx;
+static std::condition_variable fast5WorkerFree;
 
-	if ( status < 0 ){
-		free(rawptr);
-		H5Dclose(dset);
 
-		if (vbz_compressed) throw VBZError(filename);
+static bool writeAll( int fd, const void *buffer, size_t bytes ){
 
-		throw BadFast5Field();
+	const char *p = (const char *) buffer;
+	while (bytes > 0){
+
+		ssize_t n = write(fd, p, bytes);
+		if (n < 0 and errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		bytes -= n;
 	}
-	H5Dclose(dset);
+	return true;
+}
 
-	std::vector<double> signal_pA;
-	signal_pA.reserve(nsample);
-	
-	raw_unit = range / digitisation;
-	for ( size_t i = 0; i < nsample; i++ ){
 
-		signal_pA.push_back( (rawptr[i] + offset) * raw_unit );
+static bool readAll( int fd, void *buffer, size_t bytes ){
+
+	char *p = (char *) buffer;
+	while (bytes > 0){
+
+		ssize_t n = read(fd, p, bytes);
+		if (n < 0 and errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		bytes -= n;
 	}
-	
-	r.raw = signal_pA;
+	return true;
+}
+
+
+static bool writeString( int fd, const std::string &s ){
+
+	uint32_t length = s.size();
+	return writeAll(fd, &length, sizeof(length)) and writeAll(fd, s.data(), length);
+}
+
+
+static bool readString( int fd, std::string &s ){
+
+	uint32_t length;
+	if (not readAll(fd, &length, sizeof(length))) return false;
+	s.resize(length);
+	return readAll(fd, &s[0], length);
+}
+
 
-	//fail on empty signal
-	if (r.raw.size() == 0){
+static void fast5_workerLoop( int fromParent, int toParent ){
+/*runs in the worker process until the parent closes its end of the pipe */
 
-		std::cerr << "Empty signal found in fast5 file." << std::endl;
-		std::cerr << "   ReadID: " << r.readID << std::endl;
-		std::cerr << "   Filename: " << r.filename << std::endl;
-		exit(EXIT_FAILURE);
+	Fast5Cache cache;
+	std::string filename, readID;
+	while (readString(fromParent, filename)){
+
+		uint32_t count;
+		if (not readAll(fromParent, &count, sizeof(count))) break;
+		hid_t hdf5_file = cachedFast5File(cache, filename);
+
+		for (uint32_t i = 0; i < count; i++){
+
+			if (not readString(fromParent, readID)) _exit(EXIT_FAILURE);
+
+			RawSignal signal;
+			int32_t status = hdf5_file < 0 ? Fast5IOFailure : fast5_decode(hdf5_file, readID, signal);
+			uint64_t nsample = status == Fast5OK ? signal.samples.size() : 0;
+			bool sent = writeAll(toParent, &status, sizeof(status)) and writeAll(toParent, &signal.offset, sizeof(signal.offset))
+			            and writeAll(toParent, &signal.scale, sizeof(signal.scale)) and writeAll(toParent, &nsample, sizeof(nsample))
+			            and writeAll(toParent, signal.samples.data(), nsample * sizeof(int16_t));
+			if (not sent) _exit(EXIT_FAILURE);
+		}
 	}
+	cache.clear();
+	_exit(EXIT_SUCCESS);
+}
 
-	free(rawptr);
-	
-	H5Fclose(hdf5_file);
+
+void fast5_startDecodeWorkers( unsigned int n ){
+/*forks n fast5 decode processes - call before any threads are started, as only the calling thread survives a fork */
+
+	//a worker that dies shows up as a failed write or read on its pipe rather than killing the run - it's retired and
+	//its batch is decoded again elsewhere (see fast5_decodeRemote)
+	signal(SIGPIPE, SIG_IGN);
+
+	for (unsigned int i = 0; i < n; i++){
+
+		int request[2], response[2];
+		if (pipe(request) < 0 or pipe(response) < 0) throw IOerror("fast5 decode worker pipe");
+
+		pid_t pid = fork();
+		if (pid < 0) throw IOerror("fast5 decode worker");
+		if (pid == 0){
+
+			//the worker only keeps its own ends - holding other workers' pipes open would stop them seeing the parent go
+			for (auto &w : fast5Workers){
+				close(w.toWorker);
+				close(w.fromWorker);
+			}
+			close(request[1]);
+			close(response[0]);
+			fast5_workerLoop(request[0], response[1]);
+		}
+
+		close(request[0]);
+		close(response[1]);
+		Fast5Worker w;
+		w.pid = pid;
+		w.toWorker = request[1];
+		w.fromWorker = response[0];
+		fast5Workers.push_back(w);
+		idleFast5Workers.push_back(fast5Workers.size() - 1);
+		liveFast5Workers++;
+	}
 }
 
 
-void fast5_getSignal_batch( std::vector<DNAscent::read *> readBatch ){
+void fast5_stopDecodeWorkers( void ){
 
-	std::string filename = readBatch[0] -> filename;
+	for (auto &w : fast5Workers){
+		if (w.pid >= 0) close(w.toWorker);
+	}
+	for (auto &w : fast5Workers){
+		if (w.pid < 0) continue;
+		waitpid(w.pid, NULL, 0);
+		close(w.fromWorker);
+	}
+	fast5Workers.clear();
+	idleFast5Workers.clear();
+	liveFast5Workers = 0;
+}
 
-	//open the file
-	hid_t hdf5_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-	if (hdf5_file < 0) throw IOerror(filename.c_str());
-	
-	for (size_t i = 0; i < readBatch.size(); i++){
-	
-		std::string readID = readBatch[i] -> readID_fetch;
-
-		//get the channel parameters
-		std::string scaling_path = "/read_" + readID + "/channel_id";
-		hid_t scaling_group = H5Gopen(hdf5_file, scaling_path.c_str(), H5P_DEFAULT);
-		float digitisation = fast5_read_float_attribute(scaling_group, "digitisation");
-		float offset = fast5_read_float_attribute(scaling_group, "offset");
-		float range = fast5_read_float_attribute(scaling_group, "range");
-		H5Gclose(scaling_group);
-
-		//get the raw signal
-		hid_t space;
-		hsize_t nsample;
-		float raw_unit;
-		float *rawptr = NULL;
-
-		std::string signal_path = "/read_" + readID + "/Raw/Signal";
-		hid_t dset = H5Dopen(hdf5_file, signal_path.c_str(), H5P_DEFAULT);
-		if (dset < 0 ) throw BadFast5Field(); 
-		space = H5Dget_space(dset);
-		if (space < 0 ) throw BadFast5Field(); 
-		H5Sget_simple_extent_dims(space, &nsample, NULL);
-	   	rawptr = (float*)calloc(nsample, sizeof(float));
-	    	herr_t status = H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, rawptr);
-
-		if ( status < 0 ){
-			free(rawptr);
-			H5Dclose(dset);
-			throw BadFast5Field();
+
+static void fast5_retireWorker( size_t w ){
+/*a worker whose pipe failed has died or is out of step with us, so it's stopped and never handed out again */
+
+	std::lock_guard<std::mutex> lock(fast5WorkerMtx);
+	Fast5Worker &worker = fast5Workers[w];
+	close(worker.toWorker);
+	close(worker.fromWorker);
+	kill(worker.pid, SIGKILL);
+	waitpid(worker.pid, NULL, 0);
+	std::cerr << "fast5 decode worker " << worker.pid << " stopped responding and has been retired." << std::endl;
+	worker.pid = -1;
+	liveFast5Workers--;
+}
+
+
+static bool fast5_decodeOnWorker( size_t w, const std::vector<DNAscent::read *> &readBatch, std::vector< RawSignal > &signals, std::vector< Fast5Status > &statuses ){
+
+	Fast5Worker &worker = fast5Workers[w];
+
+	uint32_t count = readBatch.size();
+	bool ok = writeString(worker.toWorker, readBatch[0] -> filename) and writeAll(worker.toWorker, &count, sizeof(count));
+	for (size_t i = 0; ok and i < readBatch.size(); i++) ok = writeString(worker.toWorker, readBatch[i] -> readID_fetch);
+
+	for (size_t i = 0; ok and i < readBatch.size(); i++){
+
+		int32_t status;
+		uint64_t nsample;
+		ok = readAll(worker.fromWorker, &status, sizeof(status)) and readAll(worker.fromWorker, &signals[i].offset, sizeof(signals[i].offset))
+		     and readAll(worker.fromWorker, &signals[i].scale, sizeof(signals[i].scale)) and readAll(worker.fromWorker, &nsample, sizeof(nsample));
+		if (not ok) break;
+		signals[i].samples.resize(nsample);
+		ok = readAll(worker.fromWorker, signals[i].samples.data(), nsample * sizeof(int16_t));
+		statuses[i] = (Fast5Status) status;
+	}
+	return ok;
+}
+
+
+static bool fast5_decodeRemote( const std::vector<DNAscent::read *> &readBatch, std::vector< RawSignal > &signals, std::vector< Fast5Status > &statuses ){
+/*decodes the batch on a worker process - a worker that fails is retired and the batch is tried once more on another one,
+ *returns false if that fails too or no workers are left, so the caller can decode the batch itself */
+
+	for (int attempt = 0; attempt < 2; attempt++){
+
+		size_t w;
+		{
+			std::unique_lock<std::mutex> lock(fast5WorkerMtx);
+			fast5WorkerFree.wait(lock, []{ return not idleFast5Workers.empty() or liveFast5Workers == 0; });
+			if (liveFast5Workers == 0) return false;
+			w = idleFast5Workers.back();
+			idleFast5Workers.pop_back();
 		}
-		H5Dclose(dset);
 
-		std::vector<double> signal_pA;
-		signal_pA.reserve(nsample);
-		
-		raw_unit = range / digitisation;
-		for ( size_t i = 0; i < nsample; i++ ){
+		if (fast5_decodeOnWorker(w, readBatch, signals, statuses)){
 
-			signal_pA.push_back( (rawptr[i] + offset) * raw_unit );
+			{
+				std::lock_guard<std::mutex> lock(fast5WorkerMtx);
+				idleFast5Workers.push_back(w);
+			}
+			fast5WorkerFree.notify_one();
+			return true;
 		}
-		
-		readBatch[i] -> raw = signal_pA;
 
-		free(rawptr);
+		//threads waiting for a worker need to know if this was the last one
+		fast5_retireWorker(w);
+		fast5WorkerFree.notify_all();
+		signals.assign(readBatch.size(), RawSignal());
+		statuses.assign(readBatch.size(), Fast5OK);
 	}
-	
-	H5Fclose(hdf5_file);
+	return false;
 }
 
+
+void fast5_getSignal( DNAscent::read &r ){
+
+	fast5_getSignal_batch(std::vector< DNAscent::read * >{&r});
+}
+
+
+void fast5_getSignal_batch( const std::vector<DNAscent::read *> &readBatch ){
+/*fetches signal for reads that are all in the same fast5 file, which is opened once for all of them */
+
+	if (readBatch.empty()) return;
+	std::string filename = readBatch[0] -> filename;
+
+	std::vector< RawSignal > signals(readBatch.size());
+	std::vector< Fast5Status > statuses(readBatch.size(), Fast5OK);
+
+	//decoded in this process if there are no workers, or if they couldn't decode this batch
+	if (fast5Workers.empty() or not fast5_decodeRemote(readBatch, signals, statuses)){
+
+		//the file stays open in this thread's cache for the next read from it
+		hid_t hdf5_file = cachedFast5File(localFast5Cache(), filename);
+		if (hdf5_file < 0) throw IOerror(filename.c_str());
+
+		for (size_t i = 0; i < readBatch.size(); i++){
+
+			//all reads should be from the same fast5 file
+			assert(readBatch[i] -> filename == filename);
+			statuses[i] = fast5_decode(hdf5_file, readBatch[i] -> readID_fetch, signals[i]);
+		}
+	}
+
+	for (size_t i = 0; i < readBatch.size(); i++){
+
+		DNAscent::read &r = *readBatch[i];
+		if (statuses[i] == Fast5IOFailure) throw IOerror(filename.c_str());
+		else if (statuses[i] == Fast5VBZFailure) throw VBZError(filename);
+		else if (statuses[i] == Fast5BadField) throw BadFast5Field();
+
+		std::shared_ptr< RawSignal > signal = std::make_shared< RawSignal >(std::move(signals[i]));
+		r.raw = SignalView(signal, 0, signal -> samples.size());
+
+		//fail on empty signal
+		if (r.raw.size() == 0){
+
+			std::cerr << "Empty signal found in fast5 file." << std::endl;
+			std::cerr << "   ReadID: " << r.readID << std::endl;
+			std::cerr << "   Filename: " << r.filename << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
 std::vector<std::string> fast5_extract_readIDs(std::string filepath){
 
     hid_t hdf5_file = H5Fopen(filepath.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
@@ -232,5 +501,6 @@ std::vector<std::string> fast5_extract_readIDs(std::string filepath){
     free(buffer);
     buffer = NULL;
     buffer_size = 0;
+    H5Fclose(hdf5_file);
     return out;
 }
@@ -13,6 +13,11 @@
 #include "reads.h"
 
 void fast5_getSignal( DNAscent::read & );
+void fast5_getSignal_batch( const std::vector<DNAscent::read *> & );
+void fast5_setCacheCapacity( size_t );
+void fast5_closeCachedFiles( void );
+void fast5_startDecodeWorkers( unsigned int );
+void fast5_stopDecodeWorkers( void );
 std::vector<std::string> fast5_extract_readIDs(std::string);
 
 #endif
@@ -16,6 +16,7 @@
 #include "reads.h"
 #include "../htslib/htslib/hts.h"
 #include "../htslib/htslib/sam.h"
+#include "htsInterface.h"
 #include <cmath>
 #include <memory>
 #include <math.h>
@@ -30,11 +31,13 @@ static const char *help=
 "To run DNAscent forkSense, do:\n"
 "   DNAscent forkSense -d /path/to/detectOutput.bam -o /path/to/output.forkSense --order EdU,BrdU\n"
 "Required arguments are:\n"
-"  -d,--detect               path to output file from DNAscent detect with `detect` or `bam` extension,\n"
+"  -d,--detect               path to output file from DNAscent detect with `detect`, `bam`, or `cram` extension,\n"
 "  -o,--output               path to output file for forkSense,\n"
 "     --order                order in which the analogues were pulsed (EdU,BrdU or BrdU,EdU).\n"
 "Optional arguments are:\n"
 "  -t,--threads              number of threads (default: 1 thread),\n"
+"  --io-threads              number of threads for bam/cram decompression (default: 2 threads),\n"
+"  -r,--reference            path to the genome reference, if detect output is cram and its reference can't be found otherwise,\n"
 "  --markAnalogues           writes analogue incorporation locations to a bed file (default: off),\n"
 "  --markOrigins             writes replication origin locations to a bed file (default: off),\n"
 "  --markTerminations        writes replication termination locations to a bed file (default: off),\n"
@@ -78,7 +81,7 @@ forkSenseArgs parseSenseArguments( int argc, char** argv ){
  			
  			const char *ext = get_ext(strArg.c_str());
 				
-			if (strcmp(ext,"bam") == 0){
+			if (strcmp(ext,"bam") == 0 or strcmp(ext,"cram") == 0){
 				args.humanReadable = false;
 			}
 			else if (strcmp(ext,"detect") == 0){
@@ -118,6 +121,22 @@ forkSenseArgs parseSenseArguments( int argc, char** argv ){
 			args.threads = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--io-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);		
+
+			std::string strArg( argv[ i + 1 ] );
+			args.ioThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "-r" or flag == "--reference" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);		
+
+			std::string strArg( argv[ i + 1 ] );
+			args.referenceFilename = strArg;
+			i+=2;
+		}
 		else if ( flag == "--markOrigins" ){
 
 			args.markOrigins = true;
@@ -1533,7 +1552,10 @@ void callFractions_HR(std::string detectFilename, std::vector<double> &BrdU_call
 }
 
 
-void callFractions_modbam(std::string detectFilename, std::vector<double> &BrdU_callFractions, std::vector<double> &EdU_callFractions, int &readCount, int threads){
+void callFractions_modbam(forkSenseArgs &args, std::vector<double> &BrdU_callFractions, std::vector<double> &EdU_callFractions, int &readCount, HtsIOPool &ioPool){
+
+	std::string detectFilename = args.detectFilename;
+	int threads = args.threads;
 
 	unsigned int maxBufferSize = 20*threads;
 
@@ -1541,8 +1563,7 @@ void callFractions_modbam(std::string detectFilename, std::vector<double> &BrdU_
 	bam_hdr_t* bam_hdr;
 
 	//load the bam
-	bam_fh = sam_open(detectFilename.c_str(), "r");
-	if (bam_fh == NULL) throw IOerror(detectFilename);
+	bam_fh = openAlignmentFile(detectFilename, "r", &ioPool, args.referenceFilename);
 
 	//load the header
 	bam_hdr = sam_hdr_read(bam_fh);
@@ -1716,7 +1737,7 @@ void iterateOnHumanReadable(forkSenseArgs &args, fs_fileManager &fm, KMeansResul
 }
 
 
-void iterateOnModbam(forkSenseArgs &args, fs_fileManager &fm, KMeansResult &analogueIncorporation, int readCount){
+void iterateOnModbam(forkSenseArgs &args, fs_fileManager &fm, KMeansResult &analogueIncorporation, int readCount, HtsIOPool &ioPool){
 
 	progressBar pb(readCount,true);
 
@@ -1728,8 +1749,7 @@ void iterateOnModbam(forkSenseArgs &args, fs_fileManager &fm, KMeansResult &anal
 
 	//load the bam
 	std::cout << "Opening bam file... ";
-	bam_fh = sam_open(args.detectFilename.c_str(), "r");
-	if (bam_fh == NULL) throw IOerror(args.detectFilename);
+	bam_fh = openAlignmentFile(args.detectFilename, "r", &ioPool, args.referenceFilename);
 
 	//load the header
 	bam_hdr = sam_hdr_read(bam_fh);
@@ -1763,11 +1783,14 @@ int sense_main( int argc, char** argv ){
 
 	forkSenseArgs args = parseSenseArguments( argc, argv );
 
+	//decompresses modbam/cram input on its own threads
+	HtsIOPool ioPool(args.ioThreads);
+
 	//get call fractions and estimate analogue incorporation
 	std::vector< double > BrdU_callFractions, EdU_callFractions;
 	int readCount = 0;
 	if (args.humanReadable)	callFractions_HR(args.detectFilename, BrdU_callFractions, EdU_callFractions, readCount);
-	else callFractions_modbam(args.detectFilename, BrdU_callFractions, EdU_callFractions, readCount, args.threads);
+	else callFractions_modbam(args, BrdU_callFractions, EdU_callFractions, readCount, ioPool);
 
 	if (BrdU_callFractions.size() < 10 or EdU_callFractions.size() < 10) throw ForkSenseData();
 
@@ -1776,7 +1799,7 @@ int sense_main( int argc, char** argv ){
  	fs_fileManager fm(args, analogueIncorporation);
 
 	if (args.humanReadable) iterateOnHumanReadable(args, fm, analogueIncorporation, readCount);
-	else iterateOnModbam(args, fm, analogueIncorporation, readCount);
+	else iterateOnModbam(args, fm, analogueIncorporation, readCount, ioPool);
 
 	fm.closeAll();
 	std::cout << std::endl;
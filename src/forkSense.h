@@ -38,6 +38,8 @@ struct forkSenseArgs {
 	bool makeSignatures = false;
 	bool humanReadable = false;
 	unsigned int threads = 1;
+	unsigned int ioThreads = 2;
+	std::string referenceFilename;
 };
 
 
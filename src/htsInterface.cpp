@@ -7,26 +7,245 @@
 //----------------------------------------------------------
 
 #include "htsInterface.h"
+#include "../htslib/htslib/bgzf.h"
+#include "../htslib/htslib/thread_pool.h"
 #include <iostream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fstream>
 #include "error_handling.h"
 #include "common.h"
 
 
-void countRecords( htsFile *bam_fh, bam_hdr_t *bam_hdr, int &numOfRecords, int minQ, int minL ){
+BamProgress::BamProgress( htsFile *bam_fh, bam_hdr_t *bam_hdr, std::string bamFilename ){
 
-	std::cout << "Scanning bam file...";
+	this -> bam_fh = bam_fh;
+	_fraction = 0.0;
 
-	bam1_t *record = bam_init1();
+	//if the bam is indexed, the index already knows how many records there are
+	hts_idx_t *idx = sam_index_load3(bam_fh, bamFilename.c_str(), NULL, HTS_IDX_SILENT_FAIL);
+	if (idx != NULL){
 
-	while(sam_read1(bam_fh, bam_hdr, record) >= 0){
+		for (int tid = 0; tid < bam_hdr -> n_targets; tid++){
 
-		int refStart,refEnd;
-		getRefEnd(record,refStart,refEnd);
-		int queryLen = record -> core.l_qseq;
-		if ( (record -> core.qual >= minQ) and (refEnd - refStart >= minL) and queryLen != 0) numOfRecords++;
+			uint64_t mapped, unmapped;
+			if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0) totalRecords += mapped + unmapped;
+		}
+		totalRecords += hts_idx_get_n_no_coor(idx);
+		hts_idx_destroy(idx);
+	}
+
+	//otherwise fall back on how far through the compressed file we are
+	struct stat st;
+	if (bam_fh -> is_bgzf and stat(bamFilename.c_str(), &st) == 0) fileSize = st.st_size;
+}
+
+
+BamProgress::BamProgress( hts_pos_t totalBases ){
+
+	bam_fh = NULL;
+	this -> totalBases = totalBases;
+	_fraction = 0.0;
+}
+
+
+void BamProgress::updateBases( hts_pos_t basesDone ){
+
+	if (totalBases > 0) _fraction = std::min( (double) basesDone / (double) totalBases, 1.0 );
+}
+
+
+void BamProgress::update( void ){
+
+	recordsRead++;
+
+	if (totalRecords > 0){
+		_fraction = std::min( (double) recordsRead / (double) totalRecords, 1.0 );
+	}
+	else if (fileSize > 0){
+		//upper 48 bits of the virtual offset are the compressed offset of the current bgzf block
+		_fraction = std::min( (double) (bgzf_tell(bam_fh -> fp.bgzf) >> 16) / (double) fileSize, 1.0 );
+	}
+}
+
+
+HtsIOPool::HtsIOPool( int threads ){
+
+	pool.pool = NULL;
+	pool.qsize = 0;
+	if (threads > 0) pool.pool = hts_tpool_init(threads);
+}
+
+
+HtsIOPool::~HtsIOPool(){
+
+	if (pool.pool != NULL) hts_tpool_destroy(pool.pool);
+}
+
+
+void HtsIOPool::attach( htsFile *fh ){
+
+	if (pool.pool != NULL) hts_set_thread_pool(fh, &pool);
+}
+
+
+htsFile *openAlignmentFile( std::string filename, std::string mode, HtsIOPool *ioPool, std::string referenceFilename ){
+/*opens a sam/bam/cram file, hands its (de)compression to the shared I/O pool, and gives cram the reference it's encoded against */
+
+	htsFile *fh = sam_open(filename.c_str(), mode.c_str());
+	if (fh == NULL) throw IOerror(filename);
+
+	if ( not referenceFilename.empty() and (fh -> is_cram or mode.find('c') != std::string::npos) ){
+		if ( hts_set_fai_filename(fh, referenceFilename.c_str()) != 0 ) throw IOerror(referenceFilename);
+	}
+	if (ioPool != NULL) ioPool -> attach(fh);
+
+	return fh;
+}
+
+
+std::vector< GenomicRegion > parseRegions( bam_hdr_t *bam_hdr, const std::vector< std::string > &regionStrings, std::string bedFilename ){
+/*resolves samtools-style regions and the intervals in a bed file against the bam header, then sorts and merges them so that no record is in more than one region */
+
+	std::vector< GenomicRegion > regions;
+
+	for ( auto &str : regionStrings ){
+
+		GenomicRegion region;
+		if ( sam_parse_region(bam_hdr, str.c_str(), &region.tid, &region.beg, &region.end, HTS_PARSE_THOUSANDS_SEP) == NULL or region.tid < 0 ) throw InvalidRegion(str);
+		region.end = std::min( region.end, (hts_pos_t) bam_hdr -> target_len[region.tid] );
+		regions.push_back(region);
+	}
+
+	if ( not bedFilename.empty() ){
+
+		std::ifstream bedFile( bedFilename );
+		if ( not bedFile.is_open() ) throw IOerror( bedFilename );
+
+		std::string line;
+		while ( std::getline( bedFile, line ) ){
+
+			if ( line.empty() or line[0] == '#' or line.substr(0,5) == "track" or line.substr(0,7) == "browser" ) continue;
+
+			std::vector< std::string > fields = split( line, '\t' );
+			if ( fields.size() < 3 ) throw InvalidRegion( line );
+
+			GenomicRegion region;
+			region.tid = bam_name2id( bam_hdr, fields[0].c_str() );
+			if ( region.tid < 0 ) throw InvalidRegion( line );
+			try{
+				region.beg = std::stoll( fields[1] );
+				region.end = std::min( (hts_pos_t) std::stoll( fields[2] ), (hts_pos_t) bam_hdr -> target_len[region.tid] );
+			}
+			catch ( const std::exception & ){
+				throw InvalidRegion( line );
+			}
+			if ( region.beg < 0 or region.beg >= region.end ) continue;
+			regions.push_back(region);
+		}
+	}
+
+	std::sort( regions.begin(), regions.end(), []( const GenomicRegion &a, const GenomicRegion &b ){ return a.tid < b.tid or (a.tid == b.tid and a.beg < b.beg); } );
+
+	std::vector< GenomicRegion > merged;
+	for ( auto &region : regions ){
+
+		if ( not merged.empty() and merged.back().tid == region.tid and region.beg <= merged.back().end ) merged.back().end = std::max( merged.back().end, region.end );
+		else merged.push_back(region);
+	}
+	return merged;
+}
+
+
+std::vector< size_t > shardRegions( const std::vector< GenomicRegion > &regions, unsigned int shardIndex, unsigned int numShards ){
+/*deterministically splits regions across shards so that each shard gets about the same number of bases - largest regions are placed first, each on the least-loaded shard */
+
+	std::vector< size_t > bySize( regions.size() );
+	for ( size_t i = 0; i < regions.size(); i++ ) bySize[i] = i;
+	std::stable_sort( bySize.begin(), bySize.end(), [&regions]( size_t a, size_t b ){ return regions[a].end - regions[a].beg > regions[b].end - regions[b].beg; } );
+
+	std::vector< hts_pos_t > load( numShards, 0 );
+	std::vector< bool > inShard( regions.size(), false );
+	for ( auto i : bySize ){
+
+		unsigned int lightest = std::min_element( load.begin(), load.end() ) - load.begin();
+		load[lightest] += regions[i].end - regions[i].beg;
+		if ( lightest == shardIndex ) inShard[i] = true;
+	}
+
+	//indices of this shard's regions, in genome order
+	std::vector< size_t > shard;
+	for ( size_t i = 0; i < regions.size(); i++ ){
+		if ( inShard[i] ) shard.push_back( i );
+	}
+	return shard;
+}
+
+
+void ReadFilter::loadReadIDs( std::string filename, std::unordered_set< std::string > &readIDs ){
+/*one readID per line - anything after the first whitespace on a line is ignored */
+
+	std::ifstream inFile( filename );
+	if ( not inFile.is_open() ) throw IOerror( filename );
+
+	std::string line;
+	while ( std::getline( inFile, line ) ){
+
+		size_t end = line.find_first_of(" \t\r");
+		std::string readID = line.substr(0, end);
+		if ( not readID.empty() ) readIDs.insert( readID );
+	}
+}
+
+
+bool ReadFilter::pass( const bam1_t *record ){
+
+	const bam1_core_t &core = record -> core;
+
+	if ( core.flag & excludeFlags ) return false;
+	if ( core.qual < minQ ) return false;
+	if ( core.l_qseq == 0 ) return false;
+
+	//reference span from the cigar, same as refEnd - refStart from getRefEnd without the per-op bookkeeping
+	if ( bam_cigar2rlen(core.n_cigar, bam_get_cigar(record)) < minL ) return false;
+
+	if ( useAllowList or not denyList.empty() ){
+
+		nameBuffer.assign( bam_get_qname(record), core.l_qname - core.l_extranul - 1 );
+		if ( useAllowList and allowList.count(nameBuffer) == 0 ) return false;
+		if ( denyList.count(nameBuffer) > 0 ) return false;
+	}
+	return true;
+}
+
+
+std::string getFetchID( bam1_t *record ){
+/*readID whose signal this record is fetched from - the parent readID (pi tag) for split reads, otherwise the read name */
+
+	uint8_t *parentID = bam_aux_get(record, "pi");
+	if (parentID != NULL){
+
+		char *parentID_char = bam_aux2Z(parentID);
+		if (parentID_char != NULL and parentID_char[0] != '\0') return std::string(parentID_char);
+	}
+	return std::string(bam_get_qname(record));
+}
+
+
+bool inShard( bam1_t *record, unsigned int shardIndex, unsigned int numShards ){
+/*assigns reads to shards by a hash of the readID their signal is fetched from, so split reads land on the same shard as
+ *their parent and every process given the same N agrees on the assignment regardless of bam order */
+
+	if (numShards <= 1) return true;
+
+	//64-bit FNV-1a - std::hash isn't guaranteed to be the same between builds
+	std::string fetchID = getFetchID(record);
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c : fetchID){
+		h ^= c;
+		h *= 1099511628211ULL;
 	}
-	bam_destroy1(record);
-	std::cout << "ok." << std::endl;
+	return h % numShards == shardIndex;
 }
 
 
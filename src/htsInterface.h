@@ -12,13 +12,92 @@
 #include <utility>
 #include <vector>
 #include <map>
+#include <unordered_set>
+#include <atomic>
+#include <cstdint>
 #include "../htslib/htslib/hts.h"
 #include "../htslib/htslib/sam.h"
 
-void countRecords( htsFile *, bam_hdr_t *, int &, int , int  );
 void parseCigar(bam1_t *, std::map< unsigned int, unsigned int > &, std::map< unsigned int, unsigned int > &, std::map< unsigned int, bool > &, int &, int & );
 std::string getQuerySequence( bam1_t * );
 void getRefEnd(bam1_t *, int &, int & );
 bool indelFastFail(bam1_t *, int, int );
+std::string getFetchID( bam1_t * );
+bool inShard( bam1_t *, unsigned int, unsigned int );
+
+//an interval on one of the references in the bam header, 0-based and half-open
+struct GenomicRegion{
+	int tid;
+	hts_pos_t beg, end;
+};
+
+//one htslib thread pool shared by every sam/bam/cram file an executable opens, so bgzf and cram (de)compression
+//run on their own threads rather than on the thread that reads or writes records
+class HtsIOPool{
+
+	private:
+		htsThreadPool pool;
+
+	public:
+		HtsIOPool( int );
+		~HtsIOPool();
+		HtsIOPool( const HtsIOPool & ) = delete;
+		HtsIOPool &operator=( const HtsIOPool & ) = delete;
+		void attach( htsFile * );
+};
+
+htsFile *openAlignmentFile( std::string, std::string, HtsIOPool *, std::string );
+std::vector< GenomicRegion > parseRegions( bam_hdr_t *, const std::vector< std::string > &, std::string );
+std::vector< size_t > shardRegions( const std::vector< GenomicRegion > &, unsigned int, unsigned int );
+
+//flags of records that are dropped by default - unmapped, secondary, and supplementary alignments
+const uint16_t defaultExcludeFlags = BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+
+//cheap checks on a record straight out of the bam reader, run before it's copied so that reads which would be thrown away
+//never cost an allocation or a signal fetch - only looks at the core fields, the cigar, and the read name
+class ReadFilter{
+
+	private:
+		int minQ, minL;
+		uint16_t excludeFlags;
+		bool useAllowList = false;
+		std::unordered_set< std::string > allowList, denyList;
+		std::string nameBuffer;		//reused for readID lookups so they don't allocate once it's grown
+
+		void loadReadIDs( std::string, std::unordered_set< std::string > & );
+
+	public:
+		ReadFilter( int minQ, int minL, uint16_t excludeFlags = defaultExcludeFlags ){
+
+			this -> minQ = minQ;
+			this -> minL = minL;
+			this -> excludeFlags = excludeFlags;
+		}
+		void allowReadIDs( std::string filename ){ loadReadIDs(filename, allowList); useAllowList = true; }
+		void denyReadIDs( std::string filename ){ loadReadIDs(filename, denyList); }
+		bool pass( const bam1_t * );
+};
+
+//estimates how far the reader is through a bam file so that progress can be shown without decoding it twice
+//uses the record counts in the bai/csi index if there is one, otherwise the compressed offset against the file size
+//for region queries, progress is the number of bases covered out of the total length of the regions
+class BamProgress{
+
+	private:
+		htsFile *bam_fh;
+		uint64_t totalRecords = 0;
+		uint64_t recordsRead = 0;
+		int64_t fileSize = 0;
+		hts_pos_t totalBases = 0;
+		std::atomic<double> _fraction;
+
+	public:
+		BamProgress( htsFile *, bam_hdr_t *, std::string );
+		BamProgress( hts_pos_t );
+		void update( void );
+		void updateBases( hts_pos_t );
+		void skipRecords( uint64_t n ){ recordsRead += n; }
+		double fraction( void ) const { return _fraction.load(); }
+};
 
 #endif
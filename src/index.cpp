@@ -9,6 +9,8 @@
 #include <fstream>
 #include <omp.h>
 #include <stdio.h>
+#include <mutex>
+#include <exception>
 #include <cmath>
 #include <omp.h>
 #include "../tinydir/tinydir.h"
@@ -17,6 +19,8 @@
 #include "error_handling.h"
 #include "fast5.h"
 #include "pod5.h"
+#include "data_IO.h"
+#include "../pod5-file-format/include/pod5_format/c_api.h"
 
 #define _USE_MATH_DEFINES
 
@@ -28,7 +32,10 @@
 "  -f,--files                full path to fast5 or pod5 files.\n"
 "Optional arguments are:\n"
 "  -s,--sequencing-summary   (legacy) path to sequencing summary file from using Guppy on fast5 files,\n"
-"  -o,--output               output file name (default is index.dnascent).\n"
+"  -o,--output               output file name (default is index.dnascent),\n"
+"  -t,--threads              number of signal files to read at once (default is 1 thread),\n"
+"  --update                  only read signal files that are new or have changed since the index given by -o was made,\n"
+"  --text                    write the index in the text format that DNAscent 4.0.3 and earlier use (default is a binary index).\n"
 "DNAscent is under active development by the Boemo Group, Department of Pathology, University of Cambridge (https://www.boemogroup.org/).\n"
 "Please submit bug reports to GitHub Issues (https://github.com/MBoemo/DNAscent/issues).";
 
@@ -37,6 +44,9 @@
 	std::string seqssumPath;
 	std::string outfile;
 	bool hasSeqSum = false;
+	bool text = false;
+	unsigned int threads = 1;
+	bool update = false;
 };
 
 
@@ -87,16 +97,40 @@ Arguments_index parseIndexArguments_index( int argc, char** argv ){
 			args.outfile = strArg;
 			i+=2;
 		}
+		else if ( flag == "-t" or flag == "--threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.threads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--update" ){
+
+			args.update = true;
+			i+=1;
+		}
+		else if ( flag == "--text" ){
+
+			args.text = true;
+			i+=1;
+		}
 		else throw InvalidOption( flag );
 	}
+
+	//the index records what each file looked like when it was read, which neither text indexes nor summaries have
+	if (args.update and (args.text or args.hasSeqSum)){
+		std::cout << "Exiting with error.  --update can't be used with --text or a sequencing summary." << std::endl;
+		exit(EXIT_FAILURE);
+	}
 	return args;
 }
 
 
-std::map<std::string,std::string> parseSequencingSummary(Arguments_index &args){
+std::vector< std::pair< std::string, std::string > > parseSequencingSummary(Arguments_index &args){
+/*returns (readID, fast5 filename) for each read in the summary - only the two columns we need are picked out of each line */
 
-	std::map<std::string,std::string> readID2fast5;
-	std::map<std::string,std::vector<std::string>> fast52readID;
+	std::vector< std::pair< std::string, std::string > > readID2fast5;
 	
  	std::ifstream inFile( args.seqssumPath );
 	if ( not inFile.is_open() ) throw IOerror( args.seqssumPath );
@@ -122,66 +156,30 @@ std::map<std::string,std::string> parseSequencingSummary(Arguments_index &args){
 		std::cerr << "Please raise this as an issue on GitHub (https://github.com/MBoemo/DNAscent/issues) and paste the first few lines of the sequencing summary file." << std::endl;
 		throw IOerror( args.seqssumPath );
 	}
+	int lastColumn = std::max(column_filename, column_readID);
 	
 	while ( std::getline( inFile, line ) ){
 
-		std::string readID, fast5, column;
-		std::stringstream ssLine(line);
-		cIndex = 0;
-		
-		while( std::getline( ssLine, column, '\t' ) ){
-		
-			if (cIndex == column_filename) fast5 = column;
-			else if (cIndex == column_readID) readID = column;
-			cIndex++;
+		//walk the tabs up to the last column we need and ignore the rest of the line
+		const char *pos = line.data(), *lineEnd = line.data() + line.size();
+		const char *readID = NULL, *readIDEnd = NULL, *fast5 = NULL, *fast5End = NULL;
+		for (cIndex = 0; cIndex <= lastColumn; cIndex++){
+
+			const char *tab = (const char *) memchr(pos, '\t', lineEnd - pos);
+			const char *columnEnd = tab == NULL ? lineEnd : tab;
+			if (cIndex == column_filename){ fast5 = pos; fast5End = columnEnd; }
+			else if (cIndex == column_readID){ readID = pos; readIDEnd = columnEnd; }
+			if (tab == NULL) break;
+			pos = tab + 1;
 		}
-		readID2fast5[readID] = fast5;
-		fast52readID[fast5].push_back(readID);
+		if (readID == NULL or fast5 == NULL) continue;
+		readID2fast5.emplace_back(std::string(readID, readIDEnd), std::string(fast5, fast5End));
 	}
 
 	return readID2fast5;
 }
 
 
-void countSignalFiles(std::string path, int &count){
-
-	tinydir_dir dir;
-	unsigned int i;
-	if (tinydir_open_sorted(&dir, path.c_str()) == -1){
-		std::string error = "Error opening directory: "+path;
-		perror(error.c_str());
-		goto fail;
-	}
-
-	for (i = 0; i < dir.n_files; i++){
-
-		tinydir_file file;
-		if (tinydir_readfile_n(&dir, &file, i) == -1){
-			std::string error = "Error opening file in: "+path;
-			perror(error.c_str());
-			goto fail;
-		}
-
-		if (file.is_dir){
-
-			if (strcmp(file.name,".") != 0 and strcmp(file.name,"..") != 0){
-
-				std::string newPath = path + "/" + file.name;
-				countSignalFiles(newPath, count);
-			}
-		}
-		else{
-		
-			const char *ext = get_ext(file.name);
-			if ( strcmp(ext,"fast5") == 0 or strcmp(ext,"pod5") == 0 ) count++;
-		}
-	}
-
-	fail:
-	tinydir_close(&dir);
-}
-
-
 void readDirectory(std::string path, std::vector<std::string> &signalFilePaths){
 
 	tinydir_dir dir;
@@ -229,50 +227,157 @@ void readDirectory(std::string path, std::vector<std::string> &signalFilePaths){
 }
 
 
-bool isFileNameInPaths(const std::string& path, const std::string& fileNameToCheck) {
+static std::string baseName( const std::string &path ){
 
 	size_t lastSlashPos = path.find_last_of("/\\");
+	return (lastSlashPos != std::string::npos) ? path.substr(lastSlashPos + 1) : path;
+}
+
 
-	std::string extractedFileName = (lastSlashPos != std::string::npos) 
-		? path.substr(lastSlashPos + 1) 
-		: path;
+static std::string formatUUID( const uint8_t *uuid ){
 
-	return extractedFileName == fileNameToCheck;
+	static const char hex[] = "0123456789abcdef";
+	std::string readID;
+	for (size_t b = 0; b < 16; b++){
+		if (b == 4 or b == 6 or b == 8 or b == 10) readID += '-';
+		readID += hex[uuid[b] >> 4];
+		readID += hex[uuid[b] & 15];
+	}
+	return readID;
 }
 
 
+//reads found while crawling the signal files - readIDs are packed into 16 bytes as they're found, and only readIDs
+//that aren't UUIDs are kept as strings, which then means the index has to be written as text
+struct IndexBuilder{
+
+	std::vector< BinaryIndexEntry > entries;
+	std::vector< std::pair< std::string, BinaryIndexEntry > > otherIDs;
+
+	void add( const std::string &readID, uint32_t file, long batch, long row ){
+
+		BinaryIndexEntry e;
+		memset(&e, 0, sizeof(e));
+		e.file = file;
+		e.batch = batch < 0 ? UINT32_MAX : (uint32_t) batch;
+		e.row = row < 0 ? UINT32_MAX : (uint32_t) row;
+		if (parseUUID(readID, e.uuid)) entries.push_back(e);
+		else otherIDs.emplace_back(readID, e);
+	}
+	//moves another builder's reads onto the end of this one's
+	void append( IndexBuilder &other ){
+
+		entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+		otherIDs.insert(otherIDs.end(), other.otherIDs.begin(), other.otherIDs.end());
+		other = IndexBuilder();
+	}
+	void writeText( const std::string &filename, const std::vector< std::string > &paths ){
+
+		std::ofstream outFile( filename );
+		if ( not outFile.is_open() ) throw IOerror( filename );
+
+		auto writeLine = [&](const std::string &readID, const BinaryIndexEntry &e){
+			outFile << readID << "\t";
+			if (e.batch == UINT32_MAX) outFile << "-1\t-1\t";
+			else outFile << e.batch << "\t" << e.row << "\t";
+			outFile << paths[e.file] << "\n";
+		};
+		for (auto &e : entries) writeLine(formatUUID(e.uuid), e);
+		for (auto &o : otherIDs) writeLine(o.first, o.second);
+		outFile.close();
+		if ( not outFile.good() ) throw IOerror( filename );
+	}
+};
+
+
 int index_main( int argc, char** argv ){
 
  	Arguments_index args = parseIndexArguments_index( argc, argv );
 
-	int totalSignalFiles = 0;
-	countSignalFiles(args.sigfilesPath.c_str(), totalSignalFiles);
-
-	int progress = 0;
-	progressBar pb(totalSignalFiles,false);
+	//when updating, the reads from files that haven't changed are taken from the existing index
+	SignalIndex previous;
+	bool updating = false;
+	if (args.update){
+
+		std::ifstream exists( args.outfile );
+		if (exists.good()){
+			exists.close();
+			previous.load(args.outfile);
+			updating = previous.isBinary() and previous.fileStats().size() == previous.filePaths().size();
+			if (not updating) std::cerr << "The existing index doesn't record what its signal files looked like, so every file will be read again." << std::endl;
+		}
+	}
 
-	std::ofstream outFile( args.outfile );
-	if ( not outFile.is_open() ) throw IOerror( args.outfile );
+	//make sure the index can be written before crawling the files (without truncating it, in case it's being updated)
+	{
+		std::ofstream outFile( args.outfile, std::ios::app );
+		if ( not outFile.is_open() ) throw IOerror( args.outfile );
+	}
+	IndexBuilder index;
 
-	//iterate on the filesystem to find the full path for each signal file
+	//iterate on the filesystem to find the full path for each signal file - a single walk, which also gives the count
 	std::vector<std::string> signalFilePaths;
 	readDirectory(args.sigfilesPath.c_str(), signalFilePaths);
 
+	std::vector< SignalFileStat > signalFileStats(signalFilePaths.size());
+	for (size_t fi = 0; fi < signalFilePaths.size(); fi++){
+		if (not statSignalFile(signalFilePaths[fi], signalFileStats[fi])) throw IOerror( signalFilePaths[fi] );
+	}
+
+	//files that are the same size, with the same mtime and inode, as when they were last indexed keep their reads
+	std::vector< bool > toRead(signalFilePaths.size(), true);
+	size_t keptEntries = 0;
+	if (updating){
+
+		std::unordered_map< std::string, uint32_t > previousIDs;
+		for (size_t i = 0; i < previous.filePaths().size(); i++) previousIDs[previous.filePaths()[i]] = i;
+
+		std::vector< int64_t > newID(previous.filePaths().size(), -1);
+		for (size_t fi = 0; fi < signalFilePaths.size(); fi++){
+
+			auto p = previousIDs.find(signalFilePaths[fi]);
+			if (p != previousIDs.end() and previous.fileStats()[p -> second] == signalFileStats[fi]){
+				newID[p -> second] = fi;
+				toRead[fi] = false;
+			}
+		}
+
+		//the existing entries are sorted, and dropping the ones from changed or deleted files keeps them sorted
+		const BinaryIndexEntry *entries = previous.binaryEntries();
+		for (size_t i = 0; i < previous.size(); i++){
+
+			if (entries[i].file >= newID.size() or newID[entries[i].file] < 0) continue;
+			index.entries.push_back(entries[i]);
+			index.entries.back().file = newID[entries[i].file];
+		}
+		keptEntries = index.entries.size();
+
+		size_t unchanged = std::count(toRead.begin(), toRead.end(), false);
+		std::cout << "Keeping " << keptEntries << " reads from " << unchanged << " unchanged files, reading " << signalFilePaths.size() - unchanged << " new or changed files." << std::endl;
+	}
+
+	int progress = 0;
+	progressBar pb(std::max((size_t) 1, (size_t) std::count(toRead.begin(), toRead.end(), true)),false);
+
 	//if a user specified a sequencing summary for Guppy/fast5, use it instead of crawling through files
 	if (args.hasSeqSum){
 	
-		std::map<std::string,std::string> readID2fast5 = parseSequencingSummary(args);
-		
-		for (auto idpair = readID2fast5.begin(); idpair != readID2fast5.end(); idpair++){
+		std::vector< std::pair< std::string, std::string > > readID2fast5 = parseSequencingSummary(args);
 
-			std::string fn = idpair->second;
+		//fast5 filename -> position in signalFilePaths, so each read is one hash lookup rather than a scan over every file
+		//(the first file found with a given name wins, as it did with the scan)
+		std::unordered_map< std::string, uint32_t > fileName2path;
+		fileName2path.reserve(signalFilePaths.size());
+		for (size_t fi = 0; fi < signalFilePaths.size(); fi++) fileName2path.emplace(baseName(signalFilePaths[fi]), fi);
 
-			auto it = std::find_if(signalFilePaths.begin(), signalFilePaths.end(), [&fn](const std::string& path) {
-				return isFileNameInPaths(path, fn);
-			});
+		progressBar pbSummary(std::max((size_t) 1, readID2fast5.size()), false);
+		index.entries.reserve(readID2fast5.size());
+		for (auto idpair = readID2fast5.begin(); idpair != readID2fast5.end(); idpair++){
+
+			auto it = fileName2path.find(idpair->second);
 			
 			//check that we have the file we need and exit gracefully if not
-			if ( it == signalFilePaths.end() ){
+			if ( it == fileName2path.end() ){
 			
 				const char *ext = get_ext((idpair->second).c_str());
 				if (strcmp(ext,"fast5") != 0){
@@ -284,40 +389,77 @@ int index_main( int argc, char** argv ){
 			}
 			
 			progress++;
-			pb.displayProgress( progress, 0, 0 );
+			if (progress % 100000 == 0 or (size_t) progress == readID2fast5.size()) pbSummary.displayProgress( progress, 0, 0 );
 
-			outFile << idpair->first << "\t-1\t-1\t" << *it << std::endl;
+			index.add(idpair->first, it->second, -1, -1);
 		}
 	}
 	else{
 
+		//files are read in parallel, each into its own builder, and then merged in the order they were found so the
+		//index is the same however many threads are used
+		std::vector< IndexBuilder > perFile(signalFilePaths.size());
+		std::exception_ptr firstError;
+		std::mutex errorMtx;
+
+		pod5_init();
+
+		#pragma omp parallel for schedule(dynamic) shared(perFile,signalFilePaths,progress,pb,firstError) num_threads(args.threads)
 		for (size_t fi = 0; fi < signalFilePaths.size(); fi++){
 
-			const char *ext = get_ext((signalFilePaths[fi]).c_str());
-			if (strcmp(ext,"fast5") == 0){
-			
-				std::vector<std::string> IDs_in_file = fast5_extract_readIDs(signalFilePaths[fi]);
-				for (size_t i = 0; i < IDs_in_file.size(); i++){
-					outFile << IDs_in_file[i] << "\t-1\t-1\t" << signalFilePaths[fi] << std::endl;
+			if (not toRead[fi]) continue;
+
+			try{
+				const char *ext = get_ext((signalFilePaths[fi]).c_str());
+				if (strcmp(ext,"fast5") == 0){
+
+					std::vector<std::string> IDs_in_file = fast5_extract_readIDs(signalFilePaths[fi]);
+					for (size_t i = 0; i < IDs_in_file.size(); i++) perFile[fi].add(IDs_in_file[i], fi, -1, -1);
+				}
+				else if (strcmp(ext,"pod5") == 0){
+
+					std::vector<std::string> IDs_in_file = pod5_extract_readIDs(signalFilePaths[fi]);
+					//each entry is the readID, batch, and row separated by tabs
+					for (size_t i = 0; i < IDs_in_file.size(); i++){
+						std::vector< std::string > fields = split(IDs_in_file[i], '\t');
+						perFile[fi].add(fields[0], fi, std::stol(fields[1]), std::stol(fields[2]));
+					}
+				}
+				else{
+					std::cerr << "This doesn't look like a fast5 or pod5 file: " << signalFilePaths[fi] << std::endl;
+					throw MissingFast5(signalFilePaths[fi]);
 				}
 			}
-			else if (strcmp(ext,"pod5") == 0){
+			catch (...){
 
-				std::vector<std::string> IDs_in_file = pod5_extract_readIDs(signalFilePaths[fi]);
-				for (size_t i = 0; i < IDs_in_file.size(); i++){
-					outFile << IDs_in_file[i] << "\t" << signalFilePaths[fi] << std::endl;
-				}		
+				//exceptions can't leave an omp loop, so hold on to the first one and throw it once the loop is done
+				std::lock_guard<std::mutex> lock(errorMtx);
+				if (not firstError) firstError = std::current_exception();
 			}
-			else{
-				std::cerr << "This doesn't look like a fast5 or pod5 file: " << signalFilePaths[fi] << std::endl;
-				throw MissingFast5(signalFilePaths[fi]);
+
+			#pragma omp critical
+			{
+				progress++;
+				pb.displayProgress( progress, 0, 0 );
 			}
-			progress++;
-			pb.displayProgress( progress, 0, 0 );
 		}
+
+		pod5_terminate();
+		if (firstError) std::rethrow_exception(firstError);
+
+		for (auto &f : perFile) index.append(f);
+	}
+
+	//readIDs that aren't UUIDs can't go in a binary index
+	if (not args.text and not index.otherIDs.empty()){
+		std::cerr << "Some readIDs aren't UUIDs (e.g., " << index.otherIDs[0].first << "), so the index will be written as text." << std::endl;
 	}
+	//the new index is written alongside and moved into place, as the old one may still be mapped
+	std::string tempFilename = args.outfile + ".tmp";
+	if (args.text or not index.otherIDs.empty()) index.writeText(tempFilename, signalFilePaths);
+	else if (not writeBinaryIndex(tempFilename, signalFilePaths, signalFileStats, index.entries, keptEntries)) throw IOerror( tempFilename );
+	if (std::rename(tempFilename.c_str(), args.outfile.c_str()) != 0) throw IOerror( args.outfile );
 
-	outFile.close();
 	std::cout << std::endl;
  	return 0;
 }
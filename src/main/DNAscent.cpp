@@ -16,6 +16,7 @@
 #include "../trainCNN.h"
 #include "../alignment.h"
 #include "../trainGMM.h"
+#include "../merge.h"
 #include "../config.h"
 
 
@@ -29,6 +30,7 @@ static std::map< std::string, std::function< int( int, char** ) > > executables
 	{"align", 	align_main},
 	{"trainCNN", 	data_main},
 	{"trainGMM", 	train_main},
+	{"merge", 	merge_main},
 	{"--help",	show_options_DNAscent},
 	{"-h",		show_options_DNAscent},
 	{"-v",		show_version},
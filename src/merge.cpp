@@ -0,0 +1,273 @@
+//----------------------------------------------------------
+// Copyright 2024 University of Cambridge
+// This software is licensed under GPL-3.0.  You should have
+// received a copy of the license with this software.  If
+// not, please Email the author.
+//----------------------------------------------------------
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <cstring>
+#include "merge.h"
+#include "common.h"
+#include "error_handling.h"
+#include "htsInterface.h"
+#include "../htslib/htslib/hts.h"
+#include "../htslib/htslib/sam.h"
+
+
+static const char *help=
+"merge: DNAscent executable that merges the output of detect runs on different shards of the same bam.\n"
+"To run DNAscent merge, do:\n"
+"   DNAscent merge -o /path/to/merged.bam /path/to/shard0.bam /path/to/shard1.bam ...\n"
+"Required arguments are:\n"
+"  -o,--output               path to merged output file with extension `detect`, `bam`, or `cram`,\n"
+"  followed by the detect output files to merge, which must all be `detect` files or all be `bam`/`cram` files.\n"
+"Optional arguments are:\n"
+"  -r,--reference            path to genome reference in fasta format (required for cram input or output),\n"
+"  --io-threads              number of threads for bam/cram compression and decompression (default is 2 threads).\n"
+"Sorted bam/cram shards are merged into one sorted file. Otherwise, and for detect files, shards are concatenated in the order given.\n"
+"DNAscent is under active development by the Boemo Group, Department of Pathology, University of Cambridge (https://www.boemogroup.org/).\n"
+"Please submit bug reports to GitHub Issues (https://github.com/MBoemo/DNAscent/issues).";
+
+struct Arguments_merge {
+	std::string outputFilename;
+	std::string referenceFilename;
+	std::vector< std::string > inputFilenames;
+	bool humanReadable = false;
+	bool cram = false;
+	unsigned int ioThreads = 2;
+};
+
+Arguments_merge parseMergeArguments( int argc, char** argv ){
+
+	if( argc < 2 ){
+
+		std::cout << "Exiting with error.  Insufficient arguments passed to DNAscent merge." << std::endl << help << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if ( std::string( argv[ 1 ] ) == "-h" or std::string( argv[ 1 ] ) == "--help" ){
+
+		std::cout << help << std::endl;
+		exit(EXIT_SUCCESS);
+	}
+	else if( argc < 4 ){
+
+		std::cout << "Exiting with error.  Insufficient arguments passed to DNAscent merge." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	Arguments_merge args;
+
+	for ( int i = 1; i < argc; ){
+
+		std::string flag( argv[ i ] );
+
+		if ( flag == "-o" or flag == "--output" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.outputFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "-r" or flag == "--reference" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.referenceFilename = strArg;
+			i+=2;
+		}
+		else if ( flag == "--io-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.ioThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag.substr(0,1) == "-" ) throw InvalidOption( flag );
+		else{
+
+			args.inputFilenames.push_back(flag);
+			i+=1;
+		}
+	}
+
+	if ( args.outputFilename.empty() or args.inputFilenames.empty() ){
+
+		std::cout << "Exiting with error.  DNAscent merge needs an output file and at least one file to merge." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const char *ext = get_ext(args.outputFilename.c_str());
+	if (strcmp(ext,"detect") == 0) args.humanReadable = true;
+	else if (strcmp(ext,"cram") == 0) args.cram = true;
+	else if (strcmp(ext,"bam") != 0) throw InvalidExtension(ext);
+
+	for (auto &fn : args.inputFilenames){
+
+		if (fn == args.outputFilename) throw OverwriteFailure();
+		bool inputHumanReadable = strcmp(get_ext(fn.c_str()),"detect") == 0;
+		if (inputHumanReadable != args.humanReadable) throw MergeFormatMismatch();
+	}
+
+	return args;
+}
+
+
+//header lines that change between runs without changing the calls, so shards can differ on them
+static bool runSpecificHeaderLine( const std::string &line ){
+
+	const std::vector< std::string > runSpecific = {"#Threads", "#Compute", "#SystemStartTime", "#Software", "#Commit"};
+	for (auto &key : runSpecific){
+		if (line.compare(0, key.size(), key) == 0) return true;
+	}
+	return false;
+}
+
+
+static void mergeDetectFiles( Arguments_merge &args ){
+/*writes the header of the first file once and then the reads from each file in the order given */
+
+	std::ofstream outFile(args.outputFilename);
+	if ( not outFile.is_open() ) throw IOerror( args.outputFilename );
+
+	std::vector< std::string > firstHeader;
+	for (size_t f = 0; f < args.inputFilenames.size(); f++){
+
+		std::ifstream inFile(args.inputFilenames[f]);
+		if ( not inFile.is_open() ) throw IOerror( args.inputFilenames[f] );
+
+		std::vector< std::string > header;
+		std::string line;
+		while ( inFile.peek() == '#' and std::getline(inFile, line) ) header.push_back(line);
+
+		if (f == 0){
+			firstHeader = header;
+			for (auto &h : header) outFile << h << "\n";
+		}
+		else{
+			std::vector< std::string > a, b;
+			for (auto &h : firstHeader) if (not runSpecificHeaderLine(h)) a.push_back(h);
+			for (auto &h : header) if (not runSpecificHeaderLine(h)) b.push_back(h);
+			if (a != b) throw MergeHeaderMismatch(args.inputFilenames[f]);
+		}
+
+		//everything after the header is reads, which can be copied across as they are
+		if (inFile.peek() != std::ifstream::traits_type::eof()) outFile << inFile.rdbuf();
+		if ( not outFile.good() ) throw IOerror( args.outputFilename );
+	}
+	outFile.close();
+}
+
+
+static bool coordinateSorted( bam_hdr_t *hdr ){
+
+	std::string text(sam_hdr_str(hdr));
+	if (text.compare(0, 3, "@HD") != 0) return false;
+	std::string hdLine = text.substr(0, text.find('\n'));
+	return hdLine.find("\tSO:coordinate") != std::string::npos;
+}
+
+
+static bool sameReferences( bam_hdr_t *a, bam_hdr_t *b ){
+
+	if (a -> n_targets != b -> n_targets) return false;
+	for (int i = 0; i < a -> n_targets; i++){
+		if (a -> target_len[i] != b -> target_len[i] or strcmp(a -> target_name[i], b -> target_name[i]) != 0) return false;
+	}
+	return true;
+}
+
+
+struct MergeSource{
+	std::string filename;
+	htsFile *fh;
+	bam_hdr_t *hdr;
+	bam1_t *record;
+};
+
+
+static void mergeBamFiles( Arguments_merge &args ){
+/*writes the header of the first file once, then either merges coordinate-sorted shards into one sorted file
+ *or concatenates the shards in the order given */
+
+	HtsIOPool ioPool(args.ioThreads);
+
+	std::vector< MergeSource > sources;
+	for (auto &fn : args.inputFilenames){
+
+		MergeSource s;
+		s.filename = fn;
+		s.fh = openAlignmentFile(fn, "r", &ioPool, args.referenceFilename);
+		s.hdr = sam_hdr_read(s.fh);
+		if (s.hdr == NULL) throw IOerror(fn);
+		if (sources.size() > 0 and not sameReferences(sources[0].hdr, s.hdr)) throw MergeHeaderMismatch(fn);
+		s.record = bam_init1();
+		sources.push_back(s);
+	}
+
+	bool sorted = true;
+	for (auto &s : sources) sorted = sorted and coordinateSorted(s.hdr);
+
+	htsFile *out_fh = openAlignmentFile(args.outputFilename, args.cram ? "wc" : "wb", &ioPool, args.referenceFilename);
+	if (sam_hdr_write(out_fh, sources[0].hdr) < 0) throw BamWriteError(args.outputFilename);
+
+	auto writeRecord = [&](MergeSource &s){
+		if (sam_write1(out_fh, sources[0].hdr, s.record) < 0) throw BamWriteError(args.outputFilename);
+	};
+
+	if (sorted){
+
+		//unmapped reads have tid -1, which compares last as unsigned, and ties go to the earlier shard
+		auto later = [&](size_t i, size_t j){
+			bam1_core_t &a = sources[i].record -> core, &b = sources[j].record -> core;
+			if ((uint32_t) a.tid != (uint32_t) b.tid) return (uint32_t) a.tid > (uint32_t) b.tid;
+			if (a.pos != b.pos) return a.pos > b.pos;
+			return i > j;
+		};
+		std::priority_queue< size_t, std::vector< size_t >, decltype(later) > heads(later);
+		for (size_t i = 0; i < sources.size(); i++){
+			if (sam_read1(sources[i].fh, sources[i].hdr, sources[i].record) >= 0) heads.push(i);
+		}
+		while (not heads.empty()){
+
+			size_t i = heads.top();
+			heads.pop();
+			writeRecord(sources[i]);
+			if (sam_read1(sources[i].fh, sources[i].hdr, sources[i].record) >= 0) heads.push(i);
+		}
+	}
+	else{
+		for (auto &s : sources){
+			while (sam_read1(s.fh, s.hdr, s.record) >= 0) writeRecord(s);
+		}
+	}
+
+	if (sam_close(out_fh) < 0) throw BamWriteError(args.outputFilename);
+	for (auto &s : sources){
+		bam_destroy1(s.record);
+		bam_hdr_destroy(s.hdr);
+		sam_close(s.fh);
+	}
+}
+
+
+int merge_main( int argc, char** argv ){
+
+	Arguments_merge args = parseMergeArguments( argc, argv );
+
+	std::cout << "Merging " << args.inputFilenames.size() << " files... ";
+	if (args.humanReadable) mergeDetectFiles(args);
+	else mergeBamFiles(args);
+	std::cout << "ok." << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+//----------------------------------------------------------
+// Copyright 2024 University of Cambridge
+// This software is licensed under GPL-3.0.  You should have
+// received a copy of the license with this software.  If
+// not, please Email the author.
+//----------------------------------------------------------
+
+#ifndef MERGE_H
+#define MERGE_H
+
+
+int merge_main( int argc, char** argv );
+
+#endif
@@ -0,0 +1,332 @@
+//----------------------------------------------------------
+// Copyright 2024 University of Cambridge
+// This software is licensed under GPL-3.0.  You should have
+// received a copy of the license with this software.  If
+// not, please Email the author.
+//----------------------------------------------------------
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <deque>
+#include <map>
+#include <cstdint>
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+
+//thread-safe FIFO that blocks producers when full and consumers when empty
+//optionally, items can be given a weight (e.g. bytes) and the queue is also full once the weights queued add up to maxWeight
+template<class T>
+class BoundedQueue{
+
+	private:
+		std::deque<T> items;
+		std::deque<size_t> weights;
+		size_t capacity;
+		size_t maxWeight = 0;					//0 for no weight limit
+		size_t weight = 0;
+		std::function<size_t(const T &)> weigh;
+		bool closed = false;
+		std::mutex mtx;
+		std::condition_variable notFull, notEmpty;
+
+		//an item heavier than the whole limit still gets in on its own so that it can't block the queue forever
+		bool hasRoom(size_t w){
+
+			if (items.size() >= capacity) return false;
+			return maxWeight == 0 or items.empty() or weight + w <= maxWeight;
+		}
+		void takeFront(T &item){
+
+			item = std::move(items.front());
+			items.pop_front();
+			weight -= weights.front();
+			weights.pop_front();
+		}
+
+	public:
+		BoundedQueue( size_t capacity ){
+
+			this -> capacity = std::max(capacity, (size_t) 1);
+		}
+		void setLimit(size_t capacity, size_t maxWeight, std::function<size_t(const T &)> weigh){
+
+			std::lock_guard<std::mutex> lock(mtx);
+			this -> capacity = std::max(capacity, (size_t) 1);
+			this -> maxWeight = weigh ? maxWeight : 0;
+			this -> weigh = weigh;
+			notFull.notify_all();
+		}
+		bool push(T item){
+
+			size_t w = weigh ? weigh(item) : 0;
+			std::unique_lock<std::mutex> lock(mtx);
+			notFull.wait(lock, [this, w]{ return closed or hasRoom(w); });
+			if (closed) return false;
+			items.push_back(std::move(item));
+			weights.push_back(w);
+			weight += w;
+			notEmpty.notify_one();
+			return true;
+		}
+		bool pop(T &item){
+
+			std::unique_lock<std::mutex> lock(mtx);
+			notEmpty.wait(lock, [this]{ return closed or not items.empty(); });
+			if (items.empty()) return false;
+			takeFront(item);
+			notFull.notify_all();
+			return true;
+		}
+		//block until there is at least one item, then take as many as are waiting up to maxItems
+		bool popUpTo(std::vector<T> &out, size_t maxItems){
+
+			std::unique_lock<std::mutex> lock(mtx);
+			notEmpty.wait(lock, [this]{ return closed or not items.empty(); });
+			if (items.empty()) return false;
+			while (not items.empty() and out.size() < maxItems){
+				out.emplace_back();
+				takeFront(out.back());
+			}
+			notFull.notify_all();
+			return true;
+		}
+		//no more items will be pushed - consumers drain what is left and then stop
+		void close(void){
+
+			std::lock_guard<std::mutex> lock(mtx);
+			closed = true;
+			notFull.notify_all();
+			notEmpty.notify_all();
+		}
+		//drop everything that is queued and stop producers and consumers immediately
+		void abort(void){
+
+			std::lock_guard<std::mutex> lock(mtx);
+			closed = true;
+			items.clear();
+			weights.clear();
+			weight = 0;
+			notFull.notify_all();
+			notEmpty.notify_all();
+		}
+};
+
+
+//chain of stages connected by bounded queues where each stage has its own pool of persistent workers
+//items are moved from stage to stage so that no stage waits on a batch barrier
+//batch stages take whatever is waiting in their queue (up to a maximum) so work can be grouped when a stage is backed up
+//with ordered output, the last stage sees items in the order they were pushed regardless of which worker finished first
+template<class T>
+class Pipeline{
+
+	private:
+		//items are tagged with the order they were pushed in so the last stage can put them back in order
+		struct Slot{
+			uint64_t seq;
+			T item;
+		};
+
+		struct Stage{
+			std::string name;
+			unsigned int threads;
+			size_t batchSize;
+			std::function<void(std::vector<T> &)> work;
+			std::unique_ptr<BoundedQueue<Slot>> input;
+			std::atomic<unsigned int> running;
+		};
+
+		std::vector<std::unique_ptr<Stage>> stages;
+		std::vector<std::thread> workers;
+		size_t queueCapacity;
+		bool started = false;
+		std::mutex errorMtx;
+		std::exception_ptr firstError;
+
+		//reorder buffer in front of the last stage
+		bool ordered = false;
+		size_t maxInFlight = 0;
+		uint64_t nextSeq = 0;					//sequence number of the next item pushed
+		uint64_t nextOut = 0;					//sequence number the last stage is waiting on
+		bool aborted = false;
+		std::map<uint64_t, T> reorder;
+		std::mutex reorderMtx, flightMtx;
+		std::condition_variable flightCv;
+
+		void runBatch(Stage &s, std::vector<Slot> &batch){
+
+			std::vector<T> items;
+			items.reserve(batch.size());
+			for (auto &slot : batch) items.push_back(std::move(slot.item));
+			s.work(items);
+			for (size_t i = 0; i < batch.size(); i++) batch[i].item = std::move(items[i]);
+		}
+		//park finished items until everything before them has arrived, then run the last stage on them in order
+		void runOrdered(Stage &s, std::vector<Slot> &batch){
+
+			std::lock_guard<std::mutex> lock(reorderMtx);
+			for (auto &slot : batch) reorder.emplace(slot.seq, std::move(slot.item));
+
+			std::vector<T> items;
+			uint64_t out;
+			{
+				std::lock_guard<std::mutex> flightLock(flightMtx);
+				out = nextOut;
+			}
+			for (auto r = reorder.begin(); r != reorder.end() and r -> first == out; r = reorder.erase(r), out++){
+				items.push_back(std::move(r -> second));
+			}
+			if (items.empty()) return;
+
+			s.work(items);
+			{
+				std::lock_guard<std::mutex> flightLock(flightMtx);
+				nextOut = out;
+			}
+			flightCv.notify_all();
+		}
+		void runWorker(size_t stageIdx){
+
+			Stage &s = *stages[stageIdx];
+			BoundedQueue<Slot> *next = (stageIdx + 1 < stages.size()) ? stages[stageIdx + 1] -> input.get() : nullptr;
+
+			std::vector<Slot> batch;
+			batch.reserve(s.batchSize);
+			bool stopped = false;
+			while (not stopped and s.input -> popUpTo(batch, s.batchSize)){
+
+				try{
+					if (ordered and not next) runOrdered(s, batch);
+					else runBatch(s, batch);
+				}
+				catch (...){
+
+					fail(std::current_exception());
+					break;
+				}
+				if (next){
+					for (auto &slot : batch){
+						if (not next -> push(std::move(slot))){
+							stopped = true;
+							break;
+						}
+					}
+				}
+				batch.clear();
+			}
+
+			//the last worker out closes the queue downstream so the next stage can drain and stop
+			if (--s.running == 0 and next) next -> close();
+		}
+		void fail(std::exception_ptr e){
+
+			{
+				std::lock_guard<std::mutex> lock(errorMtx);
+				if (not firstError) firstError = e;
+			}
+			abortAll();
+		}
+		void abortAll(void){
+
+			for (auto &s : stages) s -> input -> abort();
+			{
+				std::lock_guard<std::mutex> lock(flightMtx);
+				aborted = true;
+			}
+			flightCv.notify_all();
+		}
+
+	public:
+		Pipeline( size_t queueCapacity ){
+
+			this -> queueCapacity = queueCapacity;
+		}
+		~Pipeline(){
+
+			if (started){
+				abortAll();
+				for (auto &w : workers) if (w.joinable()) w.join();
+			}
+		}
+		void addStage(std::string name, unsigned int threads, std::function<void(T &)> work){
+
+			addBatchStage(name, threads, 1, [work](std::vector<T> &batch){
+				for (auto &item : batch) work(item);
+			});
+		}
+		void addBatchStage(std::string name, unsigned int threads, size_t batchSize, std::function<void(std::vector<T> &)> work){
+
+			assert(not started);
+			std::unique_ptr<Stage> s(new Stage);
+			s -> name = name;
+			s -> threads = std::max(threads, (unsigned int) 1);
+			s -> batchSize = std::max(batchSize, (size_t) 1);
+			s -> work = work;
+			s -> input.reset(new BoundedQueue<Slot>(std::max(queueCapacity, s -> batchSize)));
+			s -> running = s -> threads;
+			stages.push_back(std::move(s));
+		}
+		//bound the input queue of the stage added last to maxItems items and, if a weigh function is given, to items
+		//weighing maxWeight in total - a deep queue in front of a stage lets the stages before it run ahead
+		void setInputLimit(size_t maxItems, size_t maxWeight = 0, std::function<size_t(const T &)> weigh = nullptr){
+
+			assert(not started and stages.size() > 0);
+			Stage &s = *stages.back();
+			std::function<size_t(const Slot &)> weighSlot;
+			if (weigh) weighSlot = [weigh](const Slot &slot){ return weigh(slot.item); };
+			s.input -> setLimit(std::max(maxItems, s.batchSize), maxWeight, weighSlot);
+		}
+		//the last stage gets items in the order they were pushed
+		//push blocks while maxInFlight items are between push and the last stage, which bounds the reorder buffer when one item is slow
+		void setOrderedOutput(size_t maxInFlight){
+
+			assert(not started);
+			ordered = true;
+			this -> maxInFlight = std::max(maxInFlight, (size_t) 1);
+		}
+		void start(void){
+
+			assert(not started and stages.size() > 0);
+			started = true;
+			for (size_t i = 0; i < stages.size(); i++){
+				for (unsigned int t = 0; t < stages[i] -> threads; t++){
+					workers.emplace_back(&Pipeline::runWorker, this, i);
+				}
+			}
+		}
+		//feed an item into the first stage - blocks while the first queue is full, returns false if the pipeline failed
+		bool push(T item){
+
+			if (ordered){
+				std::unique_lock<std::mutex> lock(flightMtx);
+				flightCv.wait(lock, [this]{ return aborted or nextSeq < nextOut + maxInFlight; });
+				if (aborted) return false;
+			}
+			Slot slot;
+			slot.seq = nextSeq++;
+			slot.item = std::move(item);
+			return stages.front() -> input -> push(std::move(slot));
+		}
+		//signal end of input, wait for every stage to drain, and rethrow the first error raised by any worker
+		void finish(void){
+
+			stages.front() -> input -> close();
+			for (auto &w : workers) w.join();
+			workers.clear();
+			started = false;
+			if (firstError) std::rethrow_exception(firstError);
+			assert(reorder.empty());
+		}
+};
+
+#endif
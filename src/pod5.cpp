@@ -15,31 +15,180 @@
 #include <string>
 #include <iostream>
 #include <array>
-#include <boost/lexical_cast.hpp>
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <cassert>
 
 
-//adapted from https://github.com/nanoporetech/pod5-file-format
-void pod5_getSignal( DNAscent::read &r ){
-	
-	std::string filepath = r.filename;
-	size_t batch_index = r.pod5_batch;
-	size_t batch_row = r.pod5_row;
-	
+//each thread keeps its own open readers and decoded read table batches so that reads from the same file and batch
+//don't reopen the file (and parse its footer) or decode the batch again - most recently used at the front
+struct Pod5Cache{
+
+	std::list< std::pair< std::string, Pod5FileReader_t * > > files;
+	std::list< std::pair< std::pair< Pod5FileReader_t *, size_t >, Pod5ReadRecordBatch_t * > > batches;
+
+	void freeBatches( Pod5FileReader_t *file ){
+
+		for (auto b = batches.begin(); b != batches.end(); ){
+
+			if (file == nullptr or b -> first.first == file){
+				pod5_free_read_batch(b -> second);
+				b = batches.erase(b);
+			}
+			else b++;
+		}
+	}
+	void clear( void ){
+
+		freeBatches(nullptr);
+		for (auto &f : files) pod5_close_and_free_reader(f.second);
+		files.clear();
+	}
+};
+
+static size_t fileCacheCapacity = 4;
+static size_t batchCacheCapacity = 16;
+
+//caches outlive the threads that own them so they can all be closed before pod5_terminate
+static std::mutex cacheRegistryMtx;
+static std::vector< std::unique_ptr< Pod5Cache > > cacheRegistry;
+
+
+static Pod5Cache &localCache( void ){
+
+	thread_local Pod5Cache *cache = nullptr;
+	if (cache == nullptr){
+
+		std::lock_guard<std::mutex> lock(cacheRegistryMtx);
+		cacheRegistry.emplace_back(new Pod5Cache);
+		cache = cacheRegistry.back().get();
+	}
+	return *cache;
+}
+
+
+void pod5_setCacheCapacity( size_t files, size_t batches ){
+/*number of open files and decoded batches each thread keeps - call before any worker threads start */
+
+	fileCacheCapacity = std::max(files, (size_t) 1);
+	batchCacheCapacity = std::max(batches, (size_t) 1);
+}
+
+
+void pod5_closeCachedFiles( void ){
+/*frees every thread's cached batches and readers - call once the threads that fetch signal have finished and before pod5_terminate */
+
+	std::lock_guard<std::mutex> lock(cacheRegistryMtx);
+	for (auto &c : cacheRegistry) c -> clear();
+}
+
+
+static Pod5FileReader_t *cachedFile( Pod5Cache &cache, const std::string &filepath ){
+
+	for (auto f = cache.files.begin(); f != cache.files.end(); f++){
+
+		if (f -> first == filepath){
+			cache.files.splice(cache.files.begin(), cache.files, f);
+			return f -> second;
+		}
+	}
+
 	Pod5FileReader_t *file = pod5_open_file(filepath.c_str());
 	if (!file) {
 		std::cerr << "Failed to open file " << filepath << ": " << pod5_get_error_string() << "\n";
-		std::cerr << "readID:  " << r.readID_fetch << "\n";
 		throw BadPod5Field();
 	}
 
+	if (cache.files.size() >= fileCacheCapacity){
+
+		Pod5FileReader_t *evict = cache.files.back().second;
+		cache.freeBatches(evict);
+		pod5_close_and_free_reader(evict);
+		cache.files.pop_back();
+	}
+	cache.files.emplace_front(filepath, file);
+	return file;
+}
+
+
+static Pod5ReadRecordBatch_t *cachedBatch( Pod5Cache &cache, Pod5FileReader_t *file, size_t batch_index ){
+
+	for (auto b = cache.batches.begin(); b != cache.batches.end(); b++){
+
+		if (b -> first.first == file and b -> first.second == batch_index){
+			cache.batches.splice(cache.batches.begin(), cache.batches, b);
+			return b -> second;
+		}
+	}
+
 	Pod5ReadRecordBatch_t *batch = nullptr;
 	if (pod5_get_read_batch(&batch, file, batch_index) != POD5_OK) {
 		std::cerr << "Failed to get batch: " << pod5_get_error_string() << "\n";
 		throw BadPod5Field();
 	}
 
+	if (cache.batches.size() >= batchCacheCapacity){
+
+		if (pod5_free_read_batch(cache.batches.back().second) != POD5_OK) {
+			std::cerr << "Failed to release batch\n";
+			throw BadPod5Field();
+		}
+		cache.batches.pop_back();
+	}
+	cache.batches.emplace_front(std::make_pair(file, batch_index), batch);
+	return batch;
+}
+
+
+static bool pod5_decodeChunks( Pod5FileReader_t *file, Pod5ReadRecordBatch_t *batch, size_t batch_row, size_t signalRows, size_t start, size_t end, RawSignal &signal ){
+/*pod5 stores a read's signal in chunks, so only decode the chunks that overlap samples [start, end) - returns false if
+ *none of them do, in which case the whole signal should be decoded */
+
+	std::vector< uint64_t > rowIndices(signalRows);
+	if (pod5_get_signal_row_indices(batch, batch_row, rowIndices.size(), rowIndices.data()) != POD5_OK){
+		std::cerr << "Failed to get signal rows for read " << batch_row << "\n";
+		throw BadPod5Field();
+	}
+	std::vector< SignalRowInfo_t * > chunks(signalRows);
+	if (pod5_get_signal_row_info(file, rowIndices.size(), rowIndices.data(), chunks.data()) != POD5_OK){
+		std::cerr << "Failed to get signal row info for read " << batch_row << "\n";
+		throw BadPod5Field();
+	}
+
+	//chunks are in signal order, so the ones that overlap the window are consecutive
+	size_t chunkStart = 0;
+	for (auto chunk : chunks){
+
+		size_t chunkEnd = chunkStart + chunk -> stored_sample_count;
+		if (chunkEnd > start and chunkStart < end){
+
+			if (signal.samples.empty()) signal.first = chunkStart;
+			size_t done = signal.samples.size();
+			signal.samples.resize(done + chunk -> stored_sample_count);
+			if (pod5_get_signal(file, chunk, chunk -> stored_sample_count, signal.samples.data() + done) != POD5_OK){
+				pod5_free_signal_row_info(chunks.size(), chunks.data());
+				std::cerr << "Failed to get signal for read " << batch_row << "\n";
+				throw BadPod5Field();
+			}
+		}
+		chunkStart = chunkEnd;
+	}
+	pod5_free_signal_row_info(chunks.size(), chunks.data());
+
+	signal.partial = true;
+	signal.total = chunkStart;
+	return not signal.samples.empty();
+}
+
+
+//adapted from https://github.com/nanoporetech/pod5-file-format
+static std::shared_ptr< RawSignal > pod5_decodeRow( Pod5FileReader_t *file, Pod5ReadRecordBatch_t *batch, size_t batch_row, size_t start = 0, size_t end = SIZE_MAX ){
+/*samples of one row of a read table batch, or just of the chunks that hold samples [start, end), and the calibration
+ *that converts them to pA */
+
 	uint16_t read_table_version = 0;
 	ReadBatchRowInfo_t read_data;
 	if (pod5_get_read_batch_row_info_data(batch, batch_row, READ_BATCH_ROW_INFO_VERSION, &read_data, &read_table_version) != POD5_OK){
@@ -47,193 +196,262 @@ void pod5_getSignal( DNAscent::read &r ){
 		throw BadPod5Field();
 	}
 
-	std::size_t sample_count = 0;
-	pod5_get_read_complete_sample_count(file, batch, batch_row, &sample_count);
-
-	std::vector<std::int16_t> samples;
-	samples.resize(sample_count);
-	pod5_get_read_complete_signal(file, batch, batch_row, samples.size(), samples.data());
-	
-	//normalise signal to pA
-	r.raw.reserve(sample_count);
-	for ( size_t i = 0; i < sample_count; i++ ){
-		r.raw.push_back( ((float) samples[i] + (float) read_data.calibration_offset) * (float) read_data.calibration_scale );
+	std::shared_ptr< RawSignal > signal = std::make_shared< RawSignal >();
+
+	//a read whose signal is in one chunk, or that keeps all of it, is decoded in one go
+	bool trimmed = start > 0 or end != SIZE_MAX;
+	if (not trimmed or read_data.signal_row_count <= 1 or not pod5_decodeChunks(file, batch, batch_row, read_data.signal_row_count, start, end, *signal)){
+
+		*signal = RawSignal();
+		std::size_t sample_count = 0;
+		pod5_get_read_complete_sample_count(file, batch, batch_row, &sample_count);
+		signal -> samples.resize(sample_count);
+		pod5_get_read_complete_signal(file, batch, batch_row, signal -> samples.size(), signal -> samples.data());
 	}
 
-	//fail on empty signal
-	if (r.raw.size() == 0){
+	//samples are kept as they are and converted to pA when they're used
+	signal -> offset = (float) read_data.calibration_offset;
+	signal -> scale = (float) read_data.calibration_scale;
 
-		std::cerr << "Empty signal found in pod5 file." << std::endl;
-		std::cerr << "   ReadID: " << r.readID << std::endl;
-		std::cerr << "   Filename: " << r.filename << std::endl;
-		std::cerr << "   Pod5 batch: " << r.pod5_batch << std::endl;
-		std::cerr << "   Pod5 row: " << r.pod5_row << std::endl;
-		exit(EXIT_FAILURE);
+	return signal;
+}
+
+
+void pod5_getSignal( DNAscent::read &r ){
+
+	pod5_getSignal_batch(std::vector< DNAscent::read * >{&r});
+}
+
+
+void pod5_getSignal_batch( const std::vector<DNAscent::read *> &readBatch ){
+/*fetches signal for reads that are all in the same pod5 file - batches are visited in file order, each batch is decoded
+ *once for every read in it, and split reads that share a parent all look at one copy of the parent's signal */
+
+	if (readBatch.empty()) return;
+	std::string filepath = readBatch[0] -> filename;
+
+	//the index already has the batch and row of every read, so the traversal plan is the reads in file order
+	//split reads are indexed under their parent, so reads that share a parent land on the same entry
+	std::map< std::pair< size_t, size_t >, std::vector< DNAscent::read * > > plan;
+	for (auto r : readBatch){
+
+		//all reads should be from the same pod5 file
+		assert(r -> filename == filepath);
+		plan[std::make_pair(r -> pod5_batch, r -> pod5_row)].push_back(r);
+	}
+
+	Pod5Cache &cache = localCache();
+
+	Pod5FileReader_t *file;
+	try{
+		file = cachedFile(cache, filepath);
+	}
+	catch (BadPod5Field &){
+		std::cerr << "readID:  " << readBatch[0] -> readID_fetch << "\n";
+		throw;
 	}
 
-	//if this is a bam file generated by dorado, apply the appropriate signal slicing
-	if ( r.signalLength > 0){
-	
-		//trim raw signal from the parent if this is a split read
-		if (r.readID != r.readID_fetch){
-		
-			assert(r.signalLength > 0);
-			size_t sig_start = r.signalStartCoord + r.signalTrim;
-			size_t sig_end = r.signalStartCoord + r.signalLength;
-			r.raw.erase(r.raw.begin(), r.raw.begin() + sig_start);
-			r.raw.erase(r.raw.begin() + (sig_end - sig_start), r.raw.end());
+	for (auto &p : plan){
+
+		DNAscent::read &first = *p.second[0];
+		bool split = false;
+		for (auto r : p.second) split = split or (r -> readID != r -> readID_fetch);
+
+		//only the samples that the reads on this row keep after Dorado's trimming need decoding
+		size_t start = SIZE_MAX, end = 0;
+		for (auto r : p.second){
+			std::pair< size_t, size_t > window = r -> signalWindow();
+			start = std::min(start, window.first);
+			end = std::max(end, window.second);
 		}
-		else{ //trim using the normal dorado bounds if the read wasn't split
 
-			size_t sig_start = r.signalTrim;
-			size_t sig_end = r.signalLength;
-			r.raw.erase(r.raw.begin(), r.raw.begin() + sig_start);
-			r.raw.erase(r.raw.begin() + (sig_end - sig_start), r.raw.end());
+		//a sibling from an earlier batch may still be holding the parent's signal, if it has the samples these reads need
+		std::shared_ptr< const RawSignal > signal;
+		if (split) signal = findSharedSignal(first.readID_fetch);
+		if (signal and not signal -> covers(start, end)) signal.reset();
+
+		if (not signal){
+
+			//the batch and reader stay open in this thread's cache for the next read from the same file
+			Pod5ReadRecordBatch_t *batch = cachedBatch(cache, file, p.first.first);
+			signal = pod5_decodeRow(file, batch, p.first.second, start, end);
+
+			//fail on empty signal
+			if (signal -> samples.size() == 0){
+
+				std::cerr << "Empty signal found in pod5 file." << std::endl;
+				std::cerr << "   ReadID: " << first.readID << std::endl;
+				std::cerr << "   Filename: " << first.filename << std::endl;
+				std::cerr << "   Pod5 batch: " << first.pod5_batch << std::endl;
+				std::cerr << "   Pod5 row: " << first.pod5_row << std::endl;
+				exit(EXIT_FAILURE);
+			}
+
+			if (split) shareSignal(first.readID_fetch, signal);
 		}
-	}
 
-	if (pod5_free_read_batch(batch) != POD5_OK) {
-		std::cerr << "Failed to release batch\n";
-		throw BadPod5Field();
+		for (auto r : p.second) r -> setSignal(signal);
 	}
-	
-	// Close the reader
-	if (pod5_close_and_free_reader(file) != POD5_OK) {
-		std::cerr << "Failed to close reader: " << pod5_get_error_string() << "\n";
-		throw BadPod5Field();
+}
+
+
+Pod5SequentialReader::Pod5SequentialReader( void ){
+
+	worker = std::thread(&Pod5SequentialReader::run, this);
+}
+
+
+Pod5SequentialReader::~Pod5SequentialReader( void ){
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopped = true;
 	}
+	changed.notify_all();
+	if (worker.joinable()) worker.join();
 }
 
 
-//adapted from https://github.com/nanoporetech/pod5-file-format
-void pod5_getSignal_batch( std::vector<DNAscent::read *> readBatch ){
-	
-	std::string filepath = readBatch[0] -> filename;
-	std::vector<boost::uuids::uuid> search_uuids;
-	std::map<std::string, std::vector<DNAscent::read *>> fetchIDToRead;
-	
-	for (size_t i = 0; i < readBatch.size(); i++){
-	
-		search_uuids.push_back(boost::lexical_cast<boost::uuids::uuid>(readBatch[i] -> readID_fetch));
-		
-		if (fetchIDToRead.count(readBatch[i] -> readID_fetch) > 0){
-		
-			fetchIDToRead[readBatch[i] -> readID_fetch].push_back(readBatch[i]);
-		}
-		else{
-			fetchIDToRead[readBatch[i] -> readID_fetch] ={readBatch[i]};		
-		}
-		
-		//all reads should be from the same pod5 file
-		assert(readBatch[i] -> filename == filepath);
+void Pod5SequentialReader::want( const std::string &fetchID, const IndexEntry &entry ){
+/*register a read that is about to be queued - call in bam order, before the read can reach take */
+
+	std::lock_guard<std::mutex> lock(mtx);
+
+	//the reader has stopped, so nothing registered now would ever be drained - the read is fetched the usual way
+	if (stopped) return;
+
+	//split reads from the same parent all take the parent's signal
+	auto w = window.find(fetchID);
+	if (w != window.end()){
+		w -> second.pending++;
+		return;
 	}
-	
-	pod5_init();
-	
-	Pod5FileReader_t *file = pod5_open_file(filepath.c_str());
 
-	std::size_t batch_count = 0;
-	if (pod5_get_read_batch_count(&batch_count, file) != POD5_OK) {
-		std::cerr << "Failed to query batch count: " << pod5_get_error_string() << "\n";
-		throw BadPod5Field();
+	auto f = fileIndex.find(entry.filepath);
+	if (f == fileIndex.end()){
+		f = fileIndex.emplace(entry.filepath, files.size()).first;
+		files.emplace_back();
+		files.back().path = entry.filepath;
 	}
-	
-	std::vector<std::uint32_t> traversal_batch_counts(batch_count);
-	std::vector<std::uint32_t> traversal_row_indices(search_uuids.size());
-	std::size_t find_success_count = 0;
-	if (pod5_plan_traversal(file, (uint8_t *)search_uuids.data(), search_uuids.size(), traversal_batch_counts.data(), traversal_row_indices.data(), &find_success_count) != POD5_OK){
-		std::cerr << "Failed to plan traversal of file: " << pod5_get_error_string() << "\n";
-		throw BadPod5Field();
+	FileCursor &cursor = files[f -> second];
+
+	//the reader has already gone past this batch, so this read will be fetched the usual way
+	if (entry.batchIndex < cursor.nextBatch) return;
+
+	Wanted &added = window[fetchID];
+	added.file = f -> second;
+	added.batch = entry.batchIndex;
+	added.row = entry.rowIndex;
+	added.pending = 1;
+	cursor.wantedRows[entry.batchIndex].push_back(fetchID);
+	order.emplace_back(f -> second, entry.batchIndex);
+	changed.notify_all();
+}
+
+
+bool Pod5SequentialReader::take( DNAscent::read &r ){
+/*gives the read its signal once the reader gets to it - returns false for stragglers (and if the reader failed), which
+ *are left to pod5_getSignal_batch */
+
+	std::shared_ptr< const RawSignal > signal;
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		auto w = window.find(r.readID_fetch);
+		if (w == window.end()) return false;
+
+		Wanted &wanted = w -> second;
+		changed.wait(lock, [&]{ return wanted.ready or stopped; });
+		signal = wanted.signal;
+		if (--wanted.pending == 0) window.erase(w);
 	}
-	
-	if (find_success_count != search_uuids.size()) {
-		std::cerr << "Failed to find " << (search_uuids.size() - find_success_count) << " reads\n";
-		throw BadPod5Field();
+	if (not signal or signal -> samples.empty()) return false;
+
+	r.setSignal(signal);
+	return true;
+}
+
+
+void Pod5SequentialReader::finish( void ){
+/*no more reads will be registered - waits for the reader to get through the ones that were */
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		noMoreReads = true;
 	}
+	changed.notify_all();
+	if (worker.joinable()) worker.join();
+}
 
-	std::size_t read_count = 0;
-	std::size_t row_offset = 0;	
 
-	for (size_t batch_index = 0; batch_index < batch_count; batch_index++) {
-		Pod5ReadRecordBatch_t *batch = nullptr;
-		if (pod5_get_read_batch(&batch, file, batch_index) != POD5_OK) {
-			std::cerr << "Failed to get batch: " << pod5_get_error_string() << "\n";
-			throw BadPod5Field();
-		}
+void Pod5SequentialReader::run( void ){
 
-		std::size_t batch_row_count = 0;
-		if (pod5_get_read_batch_row_count(&batch_row_count, batch) != POD5_OK) {
-			std::cerr << "Failed to get batch row count\n";
-			throw BadPod5Field();
-		}
-		
-		for (std::size_t row_index = 0; row_index < traversal_batch_counts[batch_index];++row_index){
-			std::uint32_t batch_row = traversal_row_indices[row_index + row_offset];
+	Pod5Cache &cache = localCache();
 
-			uint16_t read_table_version = 0;
-			ReadBatchRowInfo_t read_data;
-			if (pod5_get_read_batch_row_info_data(batch, batch_row, READ_BATCH_ROW_INFO_VERSION, &read_data, &read_table_version) != POD5_OK){
-				std::cerr << "Failed to get read " << batch_row << "\n";
-				throw BadPod5Field();
-			}
+	while (true){
 
-			std::size_t sample_count = 0;
-			pod5_get_read_complete_sample_count(file, batch, batch_row, &sample_count);
+		//claim every wanted batch of the next file in line up to the batch the oldest registered read is in
+		std::string path;
+		std::vector< std::pair< size_t, std::vector< std::pair< std::string, size_t > > > > claimed;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			changed.wait(lock, [this]{ return stopped or noMoreReads or not order.empty(); });
+			if (stopped or order.empty()) return;
 
-			std::vector<std::int16_t> samples;
-			samples.resize(sample_count);
-			pod5_get_read_complete_signal(file, batch, batch_row, samples.size(), samples.data());
-			
-			//normalise signal to pA
-			std::vector<double> signal_pA;
-			signal_pA.reserve(sample_count);
-			for ( size_t i = 0; i < sample_count; i++ ){
-				signal_pA.push_back( ((float) samples[i] + (float) read_data.calibration_offset) * (float) read_data.calibration_scale );
+			std::pair< size_t, size_t > next = order.front();
+			order.pop_front();
+			FileCursor &cursor = files[next.first];
+			if (next.second < cursor.nextBatch) continue;
+
+			path = cursor.path;
+			for (auto b = cursor.wantedRows.begin(); b != cursor.wantedRows.end() and b -> first <= next.second; b = cursor.wantedRows.erase(b)){
+
+				claimed.emplace_back(b -> first, std::vector< std::pair< std::string, size_t > >());
+				for (auto &fetchID : b -> second) claimed.back().second.emplace_back(fetchID, window.at(fetchID).row);
 			}
-			
-			//add the signal to the read (or reads) in this batch that match the fetchID
-			std::array<char, 37> formatted_read_id;
-			pod5_format_read_id(read_data.read_id, formatted_read_id.data());
-			std::string thisID = formatted_read_id.data();
-			
-			for (auto r = fetchIDToRead[thisID].begin(); r < fetchIDToRead[thisID].end(); r++){
-			
-				//if this is a bam file generated by dorado, apply the appropriate signal slicing
-				if ( (*r) -> signalLength > 0){
-			
-					//trim raw signal from the parent if this is a split read
-					if ((*r) -> readID != (*r) -> readID_fetch){
-						assert((*r) -> signalLength > 0);
-						signal_pA = std::vector<double>(signal_pA.begin() + (*r) -> signalStartCoord + (*r) -> signalTrim,
-							                        signal_pA.begin() + (*r) -> signalStartCoord + (*r) -> signalLength);
-					}
-					else{ //trim using the normal dorado bounds if the read wasn't split
-						signal_pA = std::vector<double>(signal_pA.begin() + (*r) -> signalTrim,
-							                        signal_pA.begin() + (*r) -> signalLength);				
+			cursor.nextBatch = next.second + 1;
+		}
+
+		try{
+			Pod5FileReader_t *file = cachedFile(cache, path);
+			for (auto &b : claimed){
+
+				Pod5ReadRecordBatch_t *batch = nullptr;
+				if (pod5_get_read_batch(&batch, file, b.first) != POD5_OK) {
+					std::cerr << "Failed to get batch: " << pod5_get_error_string() << "\n";
+					throw BadPod5Field();
+				}
+
+				std::vector< std::shared_ptr< const RawSignal > > signals;
+				for (auto &row : b.second) signals.push_back(pod5_decodeRow(file, batch, row.second));
+
+				if (pod5_free_read_batch(batch) != POD5_OK) {
+					std::cerr << "Failed to release batch\n";
+					throw BadPod5Field();
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					for (size_t i = 0; i < signals.size(); i++){
+						Wanted &wanted = window.at(b.second[i].first);
+						wanted.signal = signals[i];
+						wanted.ready = true;
 					}
 				}
-			
-				(*r) -> raw = signal_pA;
+				changed.notify_all();
 			}
-			
-			read_count++;
 		}
-		row_offset += traversal_batch_counts[batch_index];
-
-		if (pod5_free_read_batch(batch) != POD5_OK) {
-			std::cerr << "Failed to release batch\n";
-			throw BadPod5Field();
+		catch (std::exception &){
+
+			//everything still waiting falls back to random access, which reports the error against the read
+			//nothing will visit the rows still queued, so they're let go
+			std::lock_guard<std::mutex> lock(mtx);
+			stopped = true;
+			order.clear();
+			for (auto &cursor : files) cursor.wantedRows.clear();
+			changed.notify_all();
+			return;
 		}
 	}
-
-	// Close the reader
-	if (pod5_close_and_free_reader(file) != POD5_OK) {
-		std::cerr << "Failed to close reader: " << pod5_get_error_string() << "\n";
-		throw BadPod5Field();
-	}
-
-	// Cleanup the library
-	pod5_terminate();
 }
 
 
@@ -241,10 +459,13 @@ void pod5_getSignal_batch( std::vector<DNAscent::read *> readBatch ){
 std::vector< std::string > pod5_extract_readIDs(std::string filepath){
 
 	std::vector< std::string > readIDs;
-	
-	pod5_init();
-	
+
+	//pod5_init has already been called, once, by whoever is reading the files
 	Pod5FileReader_t *file = pod5_open_file(filepath.c_str());
+	if (!file) {
+		std::cerr << "Failed to open file " << filepath << ": " << pod5_get_error_string() << "\n";
+		throw BadPod5Field();
+	}
 
 	std::size_t batch_count = 0;
 	if (pod5_get_read_batch_count(&batch_count, file) != POD5_OK) {
@@ -297,9 +518,6 @@ std::vector< std::string > pod5_extract_readIDs(std::string filepath){
 		throw BadPod5Field();
 	}
 
-	// Cleanup the library
-	pod5_terminate();
-	
 	return readIDs;
 
 }
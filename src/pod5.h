@@ -11,11 +11,57 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <omp.h>
 #include "reads.h"
 
 void pod5_getSignal(DNAscent::read &);
-void pod5_getSignal_batch(std::vector<DNAscent::read *>);
+void pod5_getSignal_batch(const std::vector<DNAscent::read *> &);
 std::vector< std::string > pod5_extract_readIDs(std::string);
+void pod5_setCacheCapacity(size_t, size_t);
+void pod5_closeCachedFiles(void);
+
+
+//reads pod5 files front to back on its own thread, for a bam whose reads come in roughly the same order as the pod5 files
+//reads are registered in bam order as they're queued and the reader visits their batches in that order, only ever moving
+//forward in each file - a read whose batch the reader has already passed is a straggler and is left to random access
+class Pod5SequentialReader{
+
+	private:
+		struct Wanted{
+			size_t file, batch, row;
+			unsigned int pending = 0;				//reads (the parent and any split reads) still to take the signal
+			bool ready = false;
+			std::shared_ptr< const RawSignal > signal;
+		};
+		struct FileCursor{
+			std::string path;
+			size_t nextBatch = 0;					//every batch before this has been read or skipped
+			std::map< size_t, std::vector< std::string > > wantedRows;	//batch -> fetch IDs waiting on it
+		};
+
+		std::unordered_map< std::string, Wanted > window;
+		std::vector< FileCursor > files;
+		std::unordered_map< std::string, size_t > fileIndex;
+		std::deque< std::pair< size_t, size_t > > order;		//(file, batch) in the order reads were registered
+		bool noMoreReads = false, stopped = false;
+		std::mutex mtx;
+		std::condition_variable changed;
+		std::thread worker;
+
+		void run(void);
+
+	public:
+		Pod5SequentialReader(void);
+		~Pod5SequentialReader(void);
+		void want(const std::string &fetchID, const IndexEntry &entry);
+		bool take(DNAscent::read &r);
+		void finish(void);
+};
 
 #endif
@@ -0,0 +1,185 @@
+//----------------------------------------------------------
+// Copyright 2024 University of Cambridge
+// This software is licensed under GPL-3.0.  You should have
+// received a copy of the license with this software.  If
+// not, please Email the author.
+//----------------------------------------------------------
+
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "profile.h"
+#include "error_handling.h"
+
+
+bool profilingEnabled = false;
+
+static const size_t numStages = (size_t) ProfileStage::count;
+static const size_t numByteCounters = (size_t) ProfileBytes::count;
+
+static const char *stageNames[numStages] = { "signal_io", "normalisation", "event_detection", "scaling_quantiles", "banded_alignment", "scaling_theilsen", "event_alignment", "viterbi", "cnn_tensor_build", "cnn_session_run", "cnn_output", "write" };
+static const char *byteCounterNames[numByteCounters] = { "bam_records", "signal" };
+
+//reads are bucketed by length (bp) with these upper edges, plus one bucket for anything longer
+static const std::vector< size_t > lengthBucketEdges = { 1000, 5000, 10000, 20000, 50000, 100000 };
+static const size_t numLengthBuckets = 7;
+
+//latency bin 0 is under 1 ms, bin b > 0 is [2^(b-1), 2^b) ms, and the last bin takes everything slower
+static const size_t numLatencyBins = 24;
+
+struct LatencyBucket{
+	uint64_t reads = 0;
+	double totalSeconds = 0.;
+	uint64_t histogram[numLatencyBins] = {};
+};
+
+//only ever written by the thread that owns it, so updates need no locking or atomics
+struct ThreadCounters{
+	uint64_t calls[numStages] = {};
+	double wall[numStages] = {};
+	double cpu[numStages] = {};
+	uint64_t bytes[numByteCounters] = {};
+	LatencyBucket latency[numLengthBuckets];
+};
+
+//counters outlive the threads that wrote them so they can all be merged at the end
+static std::mutex registryMtx;
+static std::vector< std::unique_ptr< ThreadCounters > > registry;
+static double profileStart = 0.;
+
+
+static ThreadCounters &localCounters( void ){
+
+	thread_local ThreadCounters *counters = nullptr;
+	if (counters == nullptr){
+
+		std::lock_guard<std::mutex> lock(registryMtx);
+		registry.emplace_back(new ThreadCounters);
+		counters = registry.back().get();
+	}
+	return *counters;
+}
+
+
+void profile_enable( void ){
+
+	profilingEnabled = true;
+	profileStart = profile_wallNow();
+}
+
+
+void profile_addStageTime( ProfileStage stage, double wallSeconds, double cpuSeconds ){
+
+	ThreadCounters &c = localCounters();
+	size_t i = (size_t) stage;
+	c.calls[i]++;
+	c.wall[i] += wallSeconds;
+	c.cpu[i] += cpuSeconds;
+}
+
+
+void profile_addBytes( ProfileBytes counter, uint64_t n ){
+
+	if (not profilingEnabled) return;
+	localCounters().bytes[(size_t) counter] += n;
+}
+
+
+void profile_recordReadLatency( size_t readLength, double seconds ){
+
+	if (not profilingEnabled) return;
+
+	size_t lengthBucket = 0;
+	while (lengthBucket < lengthBucketEdges.size() and readLength >= lengthBucketEdges[lengthBucket]) lengthBucket++;
+
+	size_t bin = 0;
+	double ms = seconds * 1000.;
+	for (double edge = 1.; ms >= edge and bin < numLatencyBins - 1; edge *= 2.) bin++;
+
+	LatencyBucket &b = localCounters().latency[lengthBucket];
+	b.reads++;
+	b.totalSeconds += seconds;
+	b.histogram[bin]++;
+}
+
+
+void profile_write( std::string filename, unsigned int threads ){
+/*merges every thread's counters and writes them out as json - call after all worker threads have finished */
+
+	if (not profilingEnabled) return;
+
+	double wallTotal = profile_wallNow() - profileStart;
+
+	ThreadCounters merged;
+	size_t numThreads;
+	{
+		std::lock_guard<std::mutex> lock(registryMtx);
+		numThreads = registry.size();
+		for (auto &c : registry){
+
+			for (size_t i = 0; i < numStages; i++){
+				merged.calls[i] += c -> calls[i];
+				merged.wall[i] += c -> wall[i];
+				merged.cpu[i] += c -> cpu[i];
+			}
+			for (size_t i = 0; i < numByteCounters; i++) merged.bytes[i] += c -> bytes[i];
+			for (size_t i = 0; i < numLengthBuckets; i++){
+				merged.latency[i].reads += c -> latency[i].reads;
+				merged.latency[i].totalSeconds += c -> latency[i].totalSeconds;
+				for (size_t b = 0; b < numLatencyBins; b++) merged.latency[i].histogram[b] += c -> latency[i].histogram[b];
+			}
+		}
+	}
+
+	std::ofstream out(filename);
+	if (not out.is_open()) throw IOerror(filename);
+	out << std::fixed << std::setprecision(6);
+
+	out << "{\n";
+	out << "  \"wall_seconds\": " << wallTotal << ",\n";
+	out << "  \"threads\": " << threads << ",\n";
+	out << "  \"threads_profiled\": " << numThreads << ",\n";
+
+	//stage times are summed over threads, so wall time of a multithreaded stage can exceed the total wall time
+	out << "  \"stages\": {\n";
+	for (size_t i = 0; i < numStages; i++){
+		out << "    \"" << stageNames[i] << "\": {\"calls\": " << merged.calls[i] << ", \"wall_seconds\": " << merged.wall[i] << ", \"cpu_seconds\": " << merged.cpu[i] << "}";
+		out << (i + 1 < numStages ? ",\n" : "\n");
+	}
+	out << "  },\n";
+
+	out << "  \"bytes_read\": {\n";
+	for (size_t i = 0; i < numByteCounters; i++){
+		out << "    \"" << byteCounterNames[i] << "\": " << merged.bytes[i] << (i + 1 < numByteCounters ? ",\n" : "\n");
+	}
+	out << "  },\n";
+
+	out << "  \"read_latency\": [\n";
+	for (size_t i = 0; i < numLengthBuckets; i++){
+
+		LatencyBucket &b = merged.latency[i];
+		size_t minLength = (i == 0) ? 0 : lengthBucketEdges[i-1];
+		out << "    {\"min_length\": " << minLength << ", \"max_length\": ";
+		if (i < lengthBucketEdges.size()) out << lengthBucketEdges[i];
+		else out << "null";
+		out << ", \"reads\": " << b.reads << ", \"mean_seconds\": " << (b.reads > 0 ? b.totalSeconds / b.reads : 0.);
+
+		//keys are the upper edge of each bin in milliseconds
+		out << ", \"histogram_ms\": {";
+		bool first = true;
+		for (size_t bin = 0; bin < numLatencyBins; bin++){
+
+			if (b.histogram[bin] == 0) continue;
+			if (not first) out << ", ";
+			if (bin == numLatencyBins - 1) out << "\"inf\": ";
+			else out << "\"" << (1ULL << bin) << "\": ";
+			out << b.histogram[bin];
+			first = false;
+		}
+		out << "}}" << (i + 1 < numLengthBuckets ? ",\n" : "\n");
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
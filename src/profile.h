@@ -0,0 +1,98 @@
+//----------------------------------------------------------
+// Copyright 2024 University of Cambridge
+// This software is licensed under GPL-3.0.  You should have
+// received a copy of the license with this software.  If
+// not, please Email the author.
+//----------------------------------------------------------
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <string>
+#include <cstdint>
+#include <time.h>
+
+//parts of the detect pipeline that are timed when profiling is on - nested stages (e.g. event detection inside
+//normalisation) are timed separately and are not subtracted from the stage that contains them
+enum class ProfileStage : unsigned int {
+	SignalIO,
+	Normalisation,
+	EventDetection,
+	ScalingQuantiles,
+	BandedAlignment,
+	ScalingTheilSen,
+	EventAlignment,
+	Viterbi,
+	TensorBuild,
+	SessionRun,
+	CNNOutput,
+	Write,
+	count
+};
+
+enum class ProfileBytes : unsigned int {
+	Bam,
+	Signal,
+	count
+};
+
+//set once before any worker threads start, so it can be read without synchronisation
+extern bool profilingEnabled;
+
+void profile_enable( void );
+void profile_addBytes( ProfileBytes, uint64_t );
+void profile_recordReadLatency( size_t, double );
+void profile_write( std::string, unsigned int );
+
+//per-thread cumulative counters for one stage - written only by their own thread and merged in profile_write
+void profile_addStageTime( ProfileStage, double, double );
+
+
+inline double profile_wallNow( void ){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+inline double profile_cpuNow( void ){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+//times the enclosing scope and adds it to this thread's counters for the stage - does nothing unless profiling is on
+class ProfileTimer{
+
+	private:
+		ProfileStage stage;
+		double wallStart = 0., cpuStart = 0.;
+		bool stopped = false;
+
+	public:
+		ProfileTimer( ProfileStage stage ){
+
+			this -> stage = stage;
+			if (profilingEnabled){
+				wallStart = profile_wallNow();
+				cpuStart = profile_cpuNow();
+			}
+		}
+		~ProfileTimer(){
+
+			stop();
+		}
+		//end the timed section early, for when it doesn't line up with a scope
+		void stop( void ){
+
+			if (profilingEnabled and not stopped) profile_addStageTime(stage, profile_wallNow() - wallStart, profile_cpuNow() - cpuStart);
+			stopped = true;
+		}
+		ProfileTimer( const ProfileTimer & ) = delete;
+		ProfileTimer &operator=( const ProfileTimer & ) = delete;
+};
+
+#endif
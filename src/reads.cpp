@@ -11,21 +11,15 @@
 #include <iostream>
 #include <cassert>
 #include <memory>
+#include <mutex>
 #include "reads.h"
 
-std::vector< std::vector<DNAscent::read *> > sortReadsByFilename(std::vector<DNAscent::read> &buffer){
+std::vector< std::vector<DNAscent::read *> > sortReadsByFilename(const std::vector<DNAscent::read *> &buffer){
 
 	std::map<std::string, std::vector<DNAscent::read *> > filenameToReads;
 	for (size_t i = 0; i < buffer.size(); i++){
 	
-		if (filenameToReads.count(buffer[i].filename) == 0){
-		
-			filenameToReads[buffer[i].filename] = {&buffer[i]};
-		}
-		else{
-		
-			filenameToReads[buffer[i].filename].push_back(&buffer[i]);
-		}
+		filenameToReads[buffer[i] -> filename].push_back(buffer[i]);
 	}
 	
 	std::vector< std::vector<DNAscent::read *> > batchedReads;
@@ -36,3 +30,36 @@ std::vector< std::vector<DNAscent::read *> > sortReadsByFilename(std::vector<DNA
 	
 	return batchedReads;
 }
+
+
+//parent signals of split reads that are still held by at least one read, so that a sibling fetched later (possibly by
+//another thread) looks at the same samples instead of decoding the parent again - entries don't keep the signal alive
+static std::mutex sharedSignalMtx;
+static std::map< std::string, std::weak_ptr< const RawSignal > > sharedSignals;
+
+//parents that every read has finished with are swept out when the map doubles in size since the last sweep
+static size_t nextSharedSignalSweep = 1024;
+
+
+std::shared_ptr< const RawSignal > findSharedSignal( const std::string &fetchID ){
+
+	std::lock_guard<std::mutex> lock(sharedSignalMtx);
+	auto s = sharedSignals.find(fetchID);
+	if (s == sharedSignals.end()) return nullptr;
+	return s -> second.lock();
+}
+
+
+void shareSignal( const std::string &fetchID, std::shared_ptr< const RawSignal > signal ){
+
+	std::lock_guard<std::mutex> lock(sharedSignalMtx);
+	if (sharedSignals.size() >= nextSharedSignalSweep){
+
+		for (auto s = sharedSignals.begin(); s != sharedSignals.end(); ){
+			if (s -> second.expired()) s = sharedSignals.erase(s);
+			else s++;
+		}
+		nextSharedSignalSweep = std::max((size_t) 1024, 2 * sharedSignals.size());
+	}
+	sharedSignals[fetchID] = signal;
+}
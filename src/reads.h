@@ -17,12 +17,65 @@
 #include <iostream>
 #include <cassert>
 #include <memory>
+#include <algorithm>
+#include <cstdint>
 #include "htsInterface.h"
 #include "common.h"
 #include "error_handling.h"
 #include "data_IO.h"
 
 
+//raw samples of one read as stored by the sequencer, with the calibration that converts them to pA
+struct RawSignal{
+
+	std::vector< int16_t > samples;
+	float offset = 0., scale = 1.;
+
+	//when only the part of the signal the reads keep is decoded, samples start at sample first of the whole signal
+	bool partial = false;
+	size_t first = 0, total = 0;
+
+	//whether samples [start, end) of the whole signal, cut at its end, have been decoded
+	bool covers( size_t start, size_t end ) const {
+
+		if (not partial) return true;
+		return start >= first and std::min(end, total) <= first + samples.size();
+	}
+};
+
+
+//a read's window onto a RawSignal - reads that Dorado split from the same parent share one RawSignal,
+//which is freed when the last read looking at it goes
+class SignalView{
+
+	private:
+		std::shared_ptr< const RawSignal > signal;
+		size_t start = 0, length = 0;
+
+	public:
+		SignalView(){}
+		//start and end are positions in the whole signal, even if only part of it was decoded
+		SignalView( std::shared_ptr< const RawSignal > signal, size_t start, size_t end ){
+
+			this -> signal = signal;
+			size_t first = signal -> first, last = signal -> first + signal -> samples.size();
+			end = std::max(std::min(end, last), first);
+			start = std::min(std::max(start, first), end);
+			this -> start = start - first;
+			length = end - start;
+		}
+		size_t size( void ) const { return length; }
+		bool empty( void ) const { return length == 0; }
+		const int16_t *data( void ) const { return signal ? signal -> samples.data() + start : nullptr; }
+		int16_t operator[]( size_t i ) const { return signal -> samples[start + i]; }
+		float offset( void ) const { return signal ? signal -> offset : 0.; }
+		float scale( void ) const { return signal ? signal -> scale : 1.; }
+
+		//sample i in pA
+		double pA( size_t i ) const { return ((float) signal -> samples[start + i] + signal -> offset) * signal -> scale; }
+};
+
+
 struct PoreParameters {
 
 	double shift;
@@ -68,7 +121,7 @@ struct ReadSegment{
 struct event {
 
 	double mean;
-	std::vector< double > raw;
+	size_t rawStart = 0, rawLength = 0;		//samples of the read's raw signal that make up this event
 };
 
 
@@ -188,7 +241,7 @@ namespace DNAscent {
 		PoreParameters scalings;							//shift and scale for signal normalisation
 		BandedAlignQCs alignmentQCs;							//quality control measures for the adaptive banded event alignment
 		std::vector< event > events;							//downsampled raw signal
-		std::vector< double> raw;							//full raw signal in pA
+		SignalView raw;									//raw signal as ADC samples, possibly shared with other reads split from the same parent - converted to pA when it's used
 		std::map< unsigned int, unsigned int > refToQuery, queryToRef;			//maps from basecall 0-based indices to referenceSeqMappedTo 0-based indicies (and vice versa)
 		std::map< unsigned int, bool > refToDel;					//indicates whether a reference index is in a deletion
 		std::vector< std::pair< unsigned int, unsigned int > > eventAlignment;		//rough event alignment from adaptive banded signal alignment
@@ -206,7 +259,41 @@ namespace DNAscent {
 		size_t pod5_row;
 		
 		public:
-			read(bam1_t *record, bam_hdr_t *bam_hdr, std::map<std::string, IndexEntry> &readID2path, std::map<std::string, std::string> &reference, int flag_slow5=0){
+			//raw sample i in pA
+			double raw_pA( size_t i ) const { return raw.pA(i); }
+
+			//samples [first, second) of the signal this read is fetched with (its parent's, if it was split) that the read keeps,
+			//worked out before the signal is read so that readers can skip what Dorado trimmed - second is SIZE_MAX for all of it
+			std::pair< size_t, size_t > signalWindow( void ) const {
+
+				size_t sig_start = 0, sig_end = SIZE_MAX;
+
+				//if this is a bam file generated by dorado, apply the appropriate signal slicing
+				if ( signalLength > 0){
+
+					//trim raw signal from the parent if this is a split read
+					if (readID != readID_fetch){
+
+						sig_start = signalStartCoord + signalTrim;
+						sig_end = signalStartCoord + signalLength;
+					}
+					else{ //trim using the normal dorado bounds if the read wasn't split
+
+						sig_start = signalTrim;
+						sig_end = signalLength;
+					}
+				}
+				return std::make_pair(sig_start, sig_end);
+			}
+
+			//point this read at its part of the signal it was fetched with
+			void setSignal( std::shared_ptr< const RawSignal > signal ){
+
+				std::pair< size_t, size_t > window = signalWindow();
+				raw = SignalView(signal, window.first, window.second);
+			}
+
+			read(bam1_t *record, bam_hdr_t *bam_hdr, const SignalIndex &readIndex, std::map<std::string, std::string> &reference, int flag_slow5=0){
 				
 				this -> record = record;
 				
@@ -260,10 +347,12 @@ namespace DNAscent {
 															
 				//unpack index
 				if(flag_slow5 == 0){
-					IndexEntry ie = readID2path[readID_fetch];
-					filename = ie.filepath;
-					pod5_batch = ie.batchIndex;
-					pod5_row = ie.rowIndex;
+					IndexEntry ie;
+					if (readIndex.find(readID_fetch, ie)){
+						filename = ie.filepath;
+						pod5_batch = ie.batchIndex;
+						pod5_row = ie.rowIndex;
+					}
 				}
 
 				//get the subsequence of the reference this read mapped to
@@ -685,6 +774,8 @@ namespace DNAscent {
 }
 
 
-std::vector< std::vector<DNAscent::read *> > sortReadsByFilename(std::vector<DNAscent::read> & );
+std::vector< std::vector<DNAscent::read *> > sortReadsByFilename(const std::vector<DNAscent::read *> & );
+std::shared_ptr< const RawSignal > findSharedSignal( const std::string & );
+void shareSignal( const std::string &, std::shared_ptr< const RawSignal > );
 
 #endif
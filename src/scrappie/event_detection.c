@@ -47,6 +47,28 @@ void compute_sum_sumsq(const double *data, double *sum,
     }
 }
 
+/**
+ *   Cumulative sums as compute_sum_sumsq, for 16-bit ADC samples that are
+ *   calibrated to pA as they're summed rather than converted up front
+ *
+ *   Each sample is ((float) data[i] + offset) * scale
+ **/
+void compute_sum_sumsq_int16(const int16_t *data, float offset, float scale,
+                             double *sum, double *sumsq, size_t d_length) {
+    RETURN_NULL_IF(NULL == data, );
+    RETURN_NULL_IF(NULL == sum, );
+    RETURN_NULL_IF(NULL == sumsq, );
+    assert(d_length > 0);
+
+    sum[0] = 0.0f;
+    sumsq[0] = 0.0f;
+    for (size_t i = 0; i < d_length; ++i) {
+        const double x = ((float)data[i] + offset) * scale;
+        sum[i + 1] = sum[i] + x;
+        sumsq[i + 1] = sumsq[i] + x * x;
+    }
+}
+
 /**
  *   Compute windowed t-statistic from summary information
  *
@@ -265,15 +287,10 @@ event_table create_events(size_t const *peaks, double const *sums,
     return et;
 }
 
-event_table detect_events(double *raw, size_t raw_size, detector_param const edparam) {
+static event_table detect_events_from_sums(double *sums, double *sumsqs, size_t raw_size, detector_param const edparam) {
 
     event_table et = { 0 };
-    RETURN_NULL_IF(NULL == raw, et);
-
-    double *sums = calloc(raw_size + 1, sizeof(double));
-    double *sumsqs = calloc(raw_size + 1, sizeof(double));
 
-    compute_sum_sumsq(raw, sums, sumsqs, raw_size);
     float *tstat1 = compute_tstat(sums, sumsqs, raw_size, edparam.window_length1);
     float *tstat2 = compute_tstat(sums, sumsqs, raw_size, edparam.window_length2);
 
@@ -312,6 +329,37 @@ event_table detect_events(double *raw, size_t raw_size, detector_param const edp
     free(peaks);
     free(tstat2);
     free(tstat1);
+    return et;
+}
+
+event_table detect_events(double *raw, size_t raw_size, detector_param const edparam) {
+
+    event_table et = { 0 };
+    RETURN_NULL_IF(NULL == raw, et);
+
+    double *sums = calloc(raw_size + 1, sizeof(double));
+    double *sumsqs = calloc(raw_size + 1, sizeof(double));
+
+    compute_sum_sumsq(raw, sums, sumsqs, raw_size);
+    et = detect_events_from_sums(sums, sumsqs, raw_size, edparam);
+
+    free(sumsqs);
+    free(sums);
+
+    return et;
+}
+
+event_table detect_events_int16(const int16_t *raw, size_t raw_size, float offset, float scale, detector_param const edparam) {
+
+    event_table et = { 0 };
+    RETURN_NULL_IF(NULL == raw, et);
+
+    double *sums = calloc(raw_size + 1, sizeof(double));
+    double *sumsqs = calloc(raw_size + 1, sizeof(double));
+
+    compute_sum_sumsq_int16(raw, offset, scale, sums, sumsqs, raw_size);
+    et = detect_events_from_sums(sums, sumsqs, raw_size, edparam);
+
     free(sumsqs);
     free(sums);
 
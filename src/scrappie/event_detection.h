@@ -1,6 +1,7 @@
 #ifndef EVENT_DETECTION_H
 #    define EVENT_DETECTION_H
 
+#    include <stdint.h>
 #    include "scrappie_structures.h"
 
 #ifdef __cplusplus
@@ -33,6 +34,7 @@ static detector_param const event_detection_rna = {
 };
 
 event_table detect_events(double *raw, size_t raw_size, detector_param const edparam);
+event_table detect_events_int16(const int16_t *raw, size_t raw_size, float offset, float scale, detector_param const edparam);
 
 #ifdef __cplusplus
 }
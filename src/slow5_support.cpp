@@ -1,55 +1,262 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string>
+#include <mutex>
+#include <memory>
 #include <slow5/slow5.h>
 #include "reads.h"
+#include "common.h"
+#include "error_handling.h"
+#include "slow5_support.h"
 
 #define TO_PICOAMPS(RAW_VAL,DIGITISATION,OFFSET,RANGE) (((RAW_VAL)+(OFFSET))*((RANGE)/(DIGITISATION)))
 
+//every slow5/blow5 file is opened once and shared by all threads
+//blow5 files are mapped into memory and records are found in the file's index and read straight from the mapping (or with
+//pread if the file can't be mapped), neither of which touches the file's state, so any number of threads can fetch from the
+//same file at once - ascii slow5 goes through slow5_get, which does, so it's one thread per file
+struct Slow5File{
+	slow5_file_t *sp;
+	std::unique_ptr< std::mutex > mtx;
+	const char *map = NULL;			//whole file mapped read-only, NULL if it isn't mapped
+	size_t mapSize = 0;
+	bool plain = false;			//records and signal are stored uncompressed, so they can be parsed in place
+};
+
+static std::vector< Slow5File > slow5Files;
+
+
 int slow5_print_version(){
     fprintf(stderr,"slow5lib version: %s\n",SLOW5_LIB_VERSION);
     return 0;
 }
 
-void slow5_getSignal(DNAscent::read &r, slow5_file_t *sp){
 
-	slow5_rec_t *rec = NULL; //slow5 record to be read
-    int ret=0; //for return value
+static bool hasSuffix( const std::string &s, const std::string &suffix ){
+
+	return s.size() >= suffix.size() and s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+std::vector< std::string > slow5_fileList( std::string indexArg ){
+/*the slow5/blow5 files named by the index argument - one file or a comma-separated list, each given either as the
+ *file itself or as its .idx - or an empty list if the argument is a DNAscent index */
 
-    //fetch the read with read_id "r3"
-    ret = slow5_get(r.readID_fetch.c_str(), &rec, sp);
-    if(ret<0){
-        fprintf(stderr,"Error in when fetching the read %s\n", r.readID_fetch.c_str());
-        exit(EXIT_FAILURE);
-    }
+	std::vector< std::string > files;
+	for (auto &f : split(indexArg, ',')){
 
-    //normalise signal to pA
-	r.raw.reserve(rec->len_raw_signal);
-	for ( size_t i = 0; i < rec->len_raw_signal; i++ ){
-		r.raw.push_back( ((float) rec->raw_signal[i] + (float) rec->offset) * ((float) rec->range/(float)rec->digitisation) );
+		if (hasSuffix(f, ".blow5.idx") or hasSuffix(f, ".slow5.idx")) files.push_back(f.substr(0, f.size() - 4));
+		else if (hasSuffix(f, ".blow5") or hasSuffix(f, ".slow5")) files.push_back(f);
+		else return {};
 	}
+	return files;
+}
+
+
+static int adviceFor( Slow5Access access ){
+
+	if (access == Slow5Access::Sequential) return MADV_SEQUENTIAL;
+	else if (access == Slow5Access::WillNeed) return MADV_WILLNEED;
+	return MADV_RANDOM;
+}
+
+
+void slow5_openFiles( const std::vector< std::string > &filenames, Slow5Access access ){
+
+	for (auto &fn : filenames){
+
+		slow5_file_t *sp = slow5_open(fn.c_str(),"r");
+		if (sp == NULL) throw IOerror(fn);
 
-    //if this is a bam file generated by dorado, apply the appropriate signal slicing
-	if ( r.signalLength > 0){
-		//trim raw signal from the parent if this is a split read
-		if (r.readID != r.readID_fetch){
-			assert(r.signalLength > 0);
-			size_t sig_start = r.signalStartCoord + r.signalTrim;
-			size_t sig_end = r.signalStartCoord + r.signalLength;
-			r.raw.erase(r.raw.begin(), r.raw.begin() + sig_start);
-			r.raw.erase(r.raw.begin() + (sig_end - sig_start), r.raw.end());
+		//load the SLOW5 index (will be built if not present)
+		if (slow5_idx_load(sp) < 0) throw IOerror(fn + ".idx");
+
+		Slow5File f;
+		f.sp = sp;
+		f.mtx.reset(new std::mutex);
+
+		//map blow5 files so records are read from the page cache without a system call or a copy into a read buffer
+		if (sp -> format == SLOW5_FORMAT_BINARY){
+
+			//fstat rather than seeking, which would move the offset slow5lib's FILE is using
+			struct stat st;
+			if (fstat(sp -> meta.fd, &st) == 0 and st.st_size > 0){
+				void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, sp -> meta.fd, 0);
+				if (map != MAP_FAILED){
+					f.map = (const char *) map;
+					f.mapSize = st.st_size;
+					madvise(map, st.st_size, adviceFor(access));
+				}
+			}
+			f.plain = sp -> compress != NULL and sp -> compress -> record_press -> method == SLOW5_COMPRESS_NONE and sp -> compress -> signal_press -> method == SLOW5_COMPRESS_NONE;
 		}
-		else{ //trim using the normal dorado bounds if the read wasn't split
+		slow5Files.push_back(std::move(f));
+	}
+}
+
 
-			size_t sig_start = r.signalTrim;
-			size_t sig_end = r.signalLength;
-			r.raw.erase(r.raw.begin(), r.raw.begin() + sig_start);
-			r.raw.erase(r.raw.begin() + (sig_end - sig_start), r.raw.end());
+void slow5_closeFiles( void ){
+
+	for (auto &f : slow5Files){
+		if (f.map != NULL) munmap((void *) f.map, f.mapSize);
+		slow5_idx_unload(f.sp);
+		slow5_close(f.sp);
+	}
+	slow5Files.clear();
+}
+
+
+static bool slow5_parsePlain( const char *rec, size_t bytes, const std::string &readID, std::pair< size_t, size_t > window, RawSignal &signal ){
+/*reads the samples [window.first, window.second) straight out of an uncompressed blow5 record, which is laid out as
+ *read_id_len (uint16), read_id, read_group (uint32), digitisation, offset, range, sampling_rate (doubles), len_raw_signal
+ *(uint64), raw_signal (int16s), and then any auxiliary fields - returns false if the record doesn't look like the read,
+ *so that slow5lib can have a go */
+
+	size_t pos = 0;
+	auto take = [&](void *dest, size_t n){
+		if (pos + n > bytes) return false;
+		memcpy(dest, rec + pos, n);
+		pos += n;
+		return true;
+	};
+
+	uint16_t idLength;
+	uint32_t readGroup;
+	double digitisation, offset, range, samplingRate;
+	uint64_t nSamples;
+	if (not take(&idLength, sizeof(idLength))) return false;
+	if (idLength != readID.size() or pos + idLength > bytes or readID.compare(0, idLength, rec + pos, idLength) != 0) return false;
+	pos += idLength;
+	if (not (take(&readGroup, sizeof(readGroup)) and take(&digitisation, sizeof(double)) and take(&offset, sizeof(double))
+	         and take(&range, sizeof(double)) and take(&samplingRate, sizeof(double)) and take(&nSamples, sizeof(nSamples)))) return false;
+	if (nSamples > (bytes - pos) / sizeof(int16_t)) return false;
+
+	//the one copy, from the page cache into the signal the read keeps - just the part Dorado didn't trim, if that's known
+	size_t start = 0, end = nSamples;
+	if (window.first < std::min((size_t) nSamples, window.second)){
+		start = window.first;
+		end = std::min((size_t) nSamples, window.second);
+		signal.partial = true;
+		signal.first = start;
+		signal.total = nSamples;
+	}
+	signal.samples.resize(end - start);
+	memcpy(signal.samples.data(), rec + pos + start * sizeof(int16_t), (end - start) * sizeof(int16_t));
+	signal.offset = (float) offset;
+	signal.scale = (float) range/(float) digitisation;
+	return true;
+}
+
+
+static slow5_rec_t *slow5_fetchRecord( Slow5File &f, const std::string &readID, struct slow5_rec_idx &recordIndex ){
+/*reads and decodes one record - the record is allocated by slow5lib and freed by the caller with slow5_rec_free */
+
+	slow5_rec_t *rec = NULL;
+
+	if (f.sp -> format != SLOW5_FORMAT_BINARY){
+
+		std::lock_guard<std::mutex> lock(*f.mtx);
+		if (slow5_get(readID.c_str(), &rec, f.sp) < 0) return NULL;
+		return rec;
+	}
+
+	//a blow5 record is prefixed by its size, which the index already has
+	size_t bytes = recordIndex.size - sizeof(slow5_rec_size_t);
+	off_t offset = recordIndex.offset + sizeof(slow5_rec_size_t);
+
+	char *mem = (char *) malloc(bytes);
+	if (mem == NULL) return NULL;
+	if (f.map != NULL){
+
+		if ((size_t) offset + bytes > f.mapSize){
+			free(mem);
+			return NULL;
 		}
+		memcpy(mem, f.map + offset, bytes);
 	}
+	else{
+		size_t done = 0;
+		while (done < bytes){
 
-    //free the SLOW5 record
-    slow5_rec_free(rec);
+			ssize_t n = pread(f.sp -> meta.fd, mem + done, bytes - done, offset + done);
+			if (n <= 0){
+				free(mem);
+				return NULL;
+			}
+			done += n;
+		}
+	}
 
+	//decompresses the record if it needs to, which may swap mem for a new buffer
+	int ret = slow5_decode((void **) &mem, &bytes, &rec, f.sp);
+	free(mem);
+	if (ret < 0){
+		slow5_rec_free(rec);
+		return NULL;
+	}
+	return rec;
 }
 
+
+bool slow5_getSignal( DNAscent::read &r ){
+/*returns false, rather than stopping the run, if the read can't be found in any of the files or can't be decoded */
+
+	//a sibling split from the same parent may still be holding the parent's signal
+	bool split = r.readID != r.readID_fetch;
+	std::pair< size_t, size_t > window = r.signalWindow();
+	std::shared_ptr< const RawSignal > shared;
+	if (split) shared = findSharedSignal(r.readID_fetch);
+	if (shared and shared -> covers(window.first, window.second)){
+		r.setSignal(shared);
+		return true;
+	}
+
+	//the read can be in any of the files, so use the first index that has it
+	std::shared_ptr< RawSignal > signal = std::make_shared< RawSignal >();
+	bool found = false, parsed = false;
+	for (auto &f : slow5Files){
+
+		struct slow5_rec_idx recordIndex;
+		if (slow5_idx_get(f.sp -> index, r.readID_fetch.c_str(), &recordIndex) < 0) continue;
+		found = true;
+
+		//uncompressed records are read in place, skipping the size that prefixes them - copying out just this read's part is
+		//cheap enough that split reads don't share the parent's signal, whereas compressed records are decoded whole and shared
+		if (f.plain and f.map != NULL and recordIndex.size > sizeof(slow5_rec_size_t) and recordIndex.offset + recordIndex.size <= f.mapSize){
+			parsed = slow5_parsePlain(f.map + recordIndex.offset + sizeof(slow5_rec_size_t), recordIndex.size - sizeof(slow5_rec_size_t), r.readID_fetch, window, *signal);
+		}
+		if (parsed) break;
+
+		slow5_rec_t *rec = slow5_fetchRecord(f, r.readID_fetch, recordIndex);
+		if (rec != NULL){
+
+			//keep the samples as they are and convert to pA when they're used
+			signal -> samples.assign(rec->raw_signal, rec->raw_signal + rec->len_raw_signal);
+			signal -> offset = (float) rec->offset;
+			signal -> scale = (float) rec->range/(float)rec->digitisation;
+			parsed = true;
+
+			//free the SLOW5 record
+			slow5_rec_free(rec);
+		}
+		break;
+	}
+	if (not parsed){
+		std::cerr << r.readID << ": " << (found ? "could not read signal for " : "signal not found in slow5 files for ") << r.readID_fetch << std::endl;
+		return false;
+	}
+
+	if (signal -> samples.empty()){
+		std::cerr << r.readID << ": empty signal in slow5 file for " << r.readID_fetch << std::endl;
+		return false;
+	}
+
+	//applies the dorado signal slicing, if there is any
+	r.setSignal(signal);
+	if (split and not signal -> partial) shareSignal(r.readID_fetch, signal);
+	return true;
+}
@@ -2,9 +2,16 @@
 #define SLOW5_SUPPORT
 
 #include <string>
+#include <vector>
 #include "reads.h"
 #include <slow5/slow5.h>
 
-void slow5_print_version();
-void slow5_getSignal(DNAscent::read &r, slow5_file_t *sp);
+//how detect will move through the blow5 files, passed on to the kernel so it reads ahead (or doesn't) to suit
+enum class Slow5Access { Random, Sequential, WillNeed };
+
+int slow5_print_version();
+std::vector< std::string > slow5_fileList(std::string);
+void slow5_openFiles(const std::vector< std::string > &, Slow5Access access = Slow5Access::Random);
+void slow5_closeFiles(void);
+bool slow5_getSignal(DNAscent::read &r);
 #endif
@@ -45,10 +45,13 @@ static const char *help=
 "  -o,--output               path to output file that will be generated.\n"
 "Optional arguments are:\n"
 "  -t,--threads              number of threads (default is 1 thread),\n"
+"  --io-threads              number of threads for bam decompression (default is 2 threads),\n"
 "  --GPU                     use the GPU device indicated for prediction (default is CPU),\n"
 "  -m,--maxReads             maximum number of reads to consider,\n"
 "  -q,--quality              minimum mapping quality (default is 20),\n"
 "  -l,--length               minimum read length in bp (default is 100),\n"
+"  --exclude-flags           skip records with any of these bam flags set (default is 0x904: unmapped, secondary, and supplementary),\n"
+"  --shard                   run only shard i of N (given as i/N, 0 <= i < N) of the reads, assigned by readID so that split reads stay with their parent,\n"
 "     --HMM                  use HMM bootstrapping (default is CNN).\n"
 "DNAscent is under active development by the Boemo Group, Department of Pathology, University of Cambridge (https://www.boemogroup.org/).\n"
 "Please submit bug reports to GitHub Issues (https://github.com/MBoemo/DNAscent/issues).";
@@ -64,7 +67,10 @@ struct Arguments_trainCNN {
 	unsigned char GPUdevice = '0';
 	int minQ, maxReads;
 	int minL;
+	uint16_t excludeFlags = defaultExcludeFlags;
 	unsigned int threads;
+	unsigned int ioThreads;
+	unsigned int shard, numShards;
 };
 
 Arguments_trainCNN parseDataArguments_trainCNN( int argc, char** argv ){
@@ -90,6 +96,9 @@ Arguments_trainCNN parseDataArguments_trainCNN( int argc, char** argv ){
 
 	/*defaults - we'll override these if the option was specified by the user */
 	args.threads = 1;
+	args.ioThreads = 2;
+	args.shard = 0;
+	args.numShards = 1;
 	args.minQ = 20;
 	args.minL = 100;
 	args.capReads = false;
@@ -126,6 +135,22 @@ Arguments_trainCNN parseDataArguments_trainCNN( int argc, char** argv ){
 			args.threads = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--io-threads" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.ioThreads = std::stoi( strArg.c_str() );
+			i+=2;
+		}
+		else if ( flag == "--shard" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			parseShard(strArg, args.shard, args.numShards);
+			i+=2;
+		}
 		else if ( flag == "-q" or flag == "--quality" ){
 
 			if (i == argc-1) throw TrailingFlag(flag);
@@ -142,6 +167,14 @@ Arguments_trainCNN parseDataArguments_trainCNN( int argc, char** argv ){
 			args.minL = std::stoi( strArg.c_str() );
 			i+=2;
 		}
+		else if ( flag == "--exclude-flags" ){
+
+			if (i == argc-1) throw TrailingFlag(flag);
+
+			std::string strArg( argv[ i + 1 ] );
+			args.excludeFlags = std::stoi( strArg.c_str(), nullptr, 0 );
+			i+=2;
+		}
 		else if ( flag == "-i" or flag == "--index" ){
 
 			if (i == argc-1) throw TrailingFlag(flag);
@@ -198,8 +231,8 @@ int data_main( int argc, char** argv ){
 	Arguments_trainCNN args = parseDataArguments_trainCNN( argc, argv );
 
 	//load DNAscent index
-	std::map< std::string, IndexEntry > readID2path;
-	parseIndex( args.indexFilename, readID2path );
+	SignalIndex readIndex;
+	parseIndex( args.indexFilename, readIndex );
 
 	//get the neural network model path
 	std::string pathExe = getExePath();
@@ -238,17 +271,21 @@ int data_main( int argc, char** argv ){
 	std::ofstream outFile( args.outputFilename );
 	if ( not outFile.is_open() ) throw IOerror( args.outputFilename );
 
+	//decompresses the bam on its own threads
+	HtsIOPool ioPool(args.ioThreads);
+
 	//load the bam
 	std::cout << "Opening bam file... ";
-	htsFile *bam_fh_cr = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh_cr == NULL) throw IOerror(args.bamFilename);
-	bam_hdr_t *bam_hdr_cr = sam_hdr_read(bam_fh_cr);
+	htsFile *bam_fh = openAlignmentFile(args.bamFilename, "r", &ioPool, args.referenceFilename);
+
+	//load the header
+	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
 	std::cout << "ok." << std::endl;
 
-	/*initialise progress */
-	int numOfRecords = 0, prog = 0, failed = 0;
-	countRecords( bam_fh_cr, bam_hdr_cr, numOfRecords, args.minQ, args.minL );
-	progressBar pb(numOfRecords,true);
+	/*initialise progress - estimated from the bam as it's read so that the bam is only decoded once */
+	int prog = 0, failed = 0;
+	BamProgress bamProgress(bam_fh, bam_hdr, args.bamFilename);
+	progressBar pb(true);
 
 	pod5_init();
 
@@ -258,28 +295,19 @@ int data_main( int argc, char** argv ){
 	if ( args.threads <= 4 ) maxBufferSize = args.threads; //PLP&SY: check with Mike
 	else maxBufferSize = 4*(args.threads);
 
-	htsFile *bam_fh = sam_open((args.bamFilename).c_str(), "r");
-	if (bam_fh == NULL) throw IOerror(args.bamFilename);
-	bam_hdr_t *bam_hdr = sam_hdr_read(bam_fh);
+	ReadFilter readFilter(args.minQ, args.minL, args.excludeFlags);
+
 	bam1_t *itr_record = bam_init1();
 	int result = sam_read1(bam_fh, bam_hdr, itr_record);
 
 	while(result >= 0){
-	
-		bam1_t *record = bam_dup1(itr_record);
 
-		//add the record to the buffer if it passes the user's criteria, otherwise destroy it cleanly
-		int mappingQual = record -> core.qual;
-		int refStart,refEnd;		
-		getRefEnd(record,refStart,refEnd);
-		int queryLen = record -> core.l_qseq;
-
-		if ( mappingQual >= args.minQ and refEnd - refStart >= args.minL and queryLen != 0 ){
+		bamProgress.update();
+	
+		//add the record to the buffer if it passes the user's criteria - records that don't are never copied
+		if ( readFilter.pass(itr_record) and inShard(itr_record, args.shard, args.numShards) ){
 
-			buffer.push_back(record);
-		}
-		else{
-			bam_destroy1(record);
+			buffer.push_back(bam_dup1(itr_record));
 		}
 
 		result = sam_read1(bam_fh, bam_hdr, itr_record);
@@ -313,7 +341,7 @@ int data_main( int argc, char** argv ){
 				//}
 				//std::shared_ptr<AlignedRead> ar_annotated = eventalign(r, Pore_Substrate_Config.windowLength_align, hmm_likelihood.refposToLikelihood);
 
-				DNAscent::read r(buffer[i], bam_hdr, readID2path, reference);
+				DNAscent::read r(buffer[i], bam_hdr, readIndex, reference);
 
 				const char *ext = get_ext(r.filename.c_str());
 				
@@ -353,17 +381,19 @@ int data_main( int argc, char** argv ){
 				{
 					outFile << r.humanReadable_eventalignOut;
 					prog++;
-					pb.displayProgress( prog, failed, failedEvents );
+					pb.displayProgress( bamProgress.fraction(), prog, failed, failedEvents );
 				}
 			}
 			buffer.clear();
 		}
-		pb.displayProgress( prog, failed, failedEvents );
+		pb.displayProgress( bamProgress.fraction(), prog, failed, failedEvents );
 	}
 	bam_destroy1(itr_record);
 	bam_hdr_destroy(bam_hdr);
 	hts_close(bam_fh);
 	std::cout << std::endl;
+	pod5_closeCachedFiles();
 	pod5_terminate();
+	fast5_closeCachedFiles();
 	return 0;
 }